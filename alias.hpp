@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include "vec.hpp"
+
+/**
+ * Walker's alias table (Vose's construction):
+ * O(n) to build, O(1) to draw from a discrete distribution.
+ */
+class AliasTable
+{
+public:
+	Vec<double> prob; // prob of taking i (instead of alias[i]) in bin i
+	Vec<uint32_t> alias;
+	Vec<uint32_t> small; // work lists for build()
+	Vec<uint32_t> large;
+
+	uint32_t len() { return prob.len; }
+
+	// Build from n weights (without normalization), sum of w must be >0
+	void build(const double* w, uint32_t n)
+	{
+		prob.resize(n);
+		alias.resize(n);
+		small.clear();
+		large.clear();
+		double sum = 0;
+		for(uint32_t i=0;i<n;i++)
+			sum += w[i];
+		for(uint32_t i=0;i<n;i++)
+		{
+			prob[i] = w[i]*n/sum;
+			alias[i] = i;
+			if(prob[i]<1)
+				small.push_back(i);
+			else
+				large.push_back(i);
+		}
+		while(small.len>0 and large.len>0)
+		{
+			uint32_t s = small[small.len-1];
+			small.len--;
+			uint32_t l = large[large.len-1];
+			alias[s] = l;
+			prob[l] -= 1-prob[s];
+			if(prob[l]<1)
+			{
+				large.len--;
+				small.push_back(l);
+			}
+		}
+		// Left overs are 1 up to rounding
+		for(uint32_t i=0;i<small.len;i++)
+			prob[small[i]] = 1;
+		for(uint32_t i=0;i<large.len;i++)
+			prob[large[i]] = 1;
+	}
+
+	// Draw with u uniform in [0,1)
+	uint32_t sample(double u)
+	{
+		u *= prob.len;
+		uint32_t i = (uint32_t)u;
+		if(i>=prob.len)
+			i = prob.len-1;
+		return (u-i<prob[i])?i:alias[i];
+	}
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "vec.hpp"
+#include "qlog.hpp"
+
+/**
+ * Allocator of uint32_t blocks carved from slabs of SLAB words, so that
+ * small blocks cost no malloc() each and all of them go at once with
+ * dtor(). A released block is kept for reuse in the free list of its
+ * size class (floor of log2); when a larger block is reused, the rest
+ * is only given back by dtor(). Thread-safe.
+ */
+class Arena
+{
+public:
+	enum { SLAB = 1<<20, N_CLASS = 64 };
+
+	// Header of a released block
+	struct Free
+	{
+		Free* next;
+		uint64_t size;
+	};
+
+	Vec<uint32_t*> slab;
+	uint32_t* cur; // free space of the last slab
+	uint64_t left;
+	Free* free_list[N_CLASS];
+	uint64_t n_slab_word; // words in slabs
+	pthread_mutex_t mutex;
+
+	Arena(): cur(NULL), left(0), n_slab_word(0)
+	{
+		memset(free_list,0,sizeof(free_list));
+		pthread_mutex_init(&mutex,NULL);
+	}
+
+	~Arena()
+	{
+		dtor();
+		pthread_mutex_destroy(&mutex);
+	}
+
+	void dtor()
+	{
+		for(uint32_t i=0;i<slab.len;i++)
+			free(slab[i]);
+		slab.dtor();
+		slab.len = slab.max_len = 0;
+		cur = NULL;
+		left = 0;
+		memset(free_list,0,sizeof(free_list));
+		n_slab_word = 0;
+	}
+
+	// Block of at least n words, 8-byte aligned
+	uint32_t* alloc(uint64_t n)
+	{
+		n = round(n);
+		pthread_mutex_lock(&mutex);
+		uint32_t* x = reuse(n);
+		if(NULL==x)
+		{
+			if(n>SLAB/4)
+				x = new_slab(n);
+			else
+			{
+				if(n>left)
+				{
+					cur = new_slab(SLAB);
+					left = SLAB;
+				}
+				x = cur;
+				cur += n;
+				left -= n;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		return x;
+	}
+
+	// Give back block x of n words (as asked to alloc())
+	void release(uint32_t* x, uint64_t n)
+	{
+		if(NULL==x)
+			return;
+		n = round(n);
+		Free* f = (Free*)x;
+		f->size = n;
+		uint32_t c = log2(n);
+		pthread_mutex_lock(&mutex);
+		f->next = free_list[c];
+		free_list[c] = f;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	// Bytes taken from the system
+	uint64_t memory() { return n_slab_word*sizeof(uint32_t); }
+
+private:
+	// At least the header of a free block, keeping 8-byte alignment
+	static uint64_t round(uint64_t n) { return n<4?4:(n+1)/2*2; }
+
+	static uint32_t log2(uint64_t n) { return 63-__builtin_clzll(n); }
+
+	// A released block of at least n words: the first few of class
+	// log2(n), then any of a larger class
+	uint32_t* reuse(uint64_t n)
+	{
+		uint32_t c = log2(n);
+		Free** p = &free_list[c];
+		for(uint32_t i=0;i<8 and NULL!=*p;i++,p=&((*p)->next))
+			if((*p)->size>=n)
+			{
+				Free* f = *p;
+				*p = f->next;
+				return (uint32_t*)f;
+			}
+		for(c++;c<N_CLASS;c++)
+			if(NULL!=free_list[c])
+			{
+				Free* f = free_list[c];
+				free_list[c] = f->next;
+				return (uint32_t*)f;
+			}
+		return NULL;
+	}
+
+	uint32_t* new_slab(uint64_t n)
+	{
+		uint32_t* x = (uint32_t*)malloc(n*sizeof(uint32_t));
+		if(NULL==x)
+			error("Cannot allocate %lu words\n",(unsigned long)n);
+		slab.push_back(x);
+		n_slab_word += n;
+		return x;
+	}
+};
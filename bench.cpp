@@ -0,0 +1,363 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <unistd.h>
+#include "rng.hpp"
+#include "hdp.hpp"
+#include "corpus.hpp"
+#include "pct.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Micro-benchmarks of the sampler kernels on a synthetic corpus, for
+ * each number of menus K and tables per doc T in the given lists.
+ * Reported per token (per table for reassign_table, per item for the
+ * small kernels): wall time, TSC cycles and malloc/realloc calls.
+ */
+
+// Count allocations by wrapping glibc's allocator
+static uint64_t n_alloc = 0;
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* malloc(size_t n) { __sync_fetch_and_add(&n_alloc,1); return __libc_malloc(n); }
+void* calloc(size_t n, size_t s) { __sync_fetch_and_add(&n_alloc,1); return __libc_calloc(n,s); }
+void* realloc(void* p, size_t n) { __sync_fetch_and_add(&n_alloc,1); return __libc_realloc(p,n); }
+}
+#endif
+
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+/**
+ * Time of a kernel over n items
+ */
+struct Timer
+{
+	double t;
+	uint64_t c;
+	uint64_t a;
+
+	void start()
+	{
+		a = n_alloc;
+		c = cycles();
+		t = now();
+	}
+
+	void report(const char* kernel, uint32_t K, uint32_t T, uint64_t n)
+	{
+		double dt = now()-t;
+		uint64_t dc = cycles()-c;
+		uint64_t da = n_alloc-a;
+		if(0==n)
+			n = 1;
+		printf("%-16s %6u %4u %12.1f %12.1f %10.4f\n",kernel,K,T,
+				dt*1e9/n,(double)dc/n,(double)da/n);
+		fflush(stdout);
+	}
+};
+
+/**
+ * Synthetic lda-c corpus: doc lengths uniform in [len/2,3*len/2],
+ * word ids drawn from a Zipf law with exponent s (word 0 most frequent).
+ */
+void gen_corpus(const char* filename, uint32_t n_doc, uint32_t len,
+		uint32_t n_word, double s)
+{
+	double* cum = (double*)malloc(n_word*sizeof(double));
+	double acc = 0;
+	for(uint32_t w=0;w<n_word;w++)
+		cum[w] = (acc += pow(w+1.0,-s));
+	uint32_t* cnt = (uint32_t*)malloc(n_word*sizeof(uint32_t));
+	memset(cnt,0,n_word*sizeof(uint32_t));
+	Vec<uint32_t> words;
+	FILE* f = fopen(filename,"w");
+	if(!f)
+		error("Cannot open %s for writing.\n",filename);
+	for(uint32_t d=0;d<n_doc;d++)
+	{
+		uint32_t n = len/2+lcg64()%(len+1);
+		words.clear();
+		for(uint32_t i=0;i<n;i++)
+		{
+			double r = drand()*acc;
+			uint32_t lo = 0, hi = n_word-1;
+			while(lo<hi)
+			{
+				uint32_t mid = (lo+hi)/2;
+				if(cum[mid]<r)
+					lo = mid+1;
+				else
+					hi = mid;
+			}
+			if(0==cnt[lo]++)
+				words.push_back(lo);
+		}
+		fprintf(f,"%u",words.len);
+		for(uint32_t i=0;i<words.len;i++)
+		{
+			fprintf(f," %u:%u",words[i],cnt[words[i]]);
+			cnt[words[i]] = 0;
+		}
+		fprintf(f,"\n");
+	}
+	fclose(f);
+	free(cnt);
+	free(cum);
+}
+
+/**
+ * State with K menus and T tables per doc: word i sits at table i%T,
+ * tables take random menus.
+ */
+void setup(HDP& h, uint32_t K, uint32_t T)
+{
+	for(uint32_t k=0;k<K;k++)
+		h.add_menu();
+	for(uint32_t d=0;d<h.n_doc;d++)
+	{
+		uint32_t n_t = T<h.dat[d].len?T:h.dat[d].len;
+		for(uint32_t t=0;t<n_t;t++)
+		{
+			uint32_t k = lcg64()%K;
+			h.add_table(d,k);
+			h.menu_stat[k]++;
+			h.menu_stat_sum++;
+		}
+		for(uint32_t i=0;i<h.dat[d].len;i++)
+		{
+			uint32_t t = i%n_t;
+			uint32_t k = h.menu[d][t];
+			h.link_word(d,i,t);
+			h.word_stat.inc(k,h.dat[d][i]);
+			h.word_stat_sum[k]++;
+			h.table_stat[d][t]++;
+		}
+	}
+}
+
+// Parse "a,b,c"
+void parse_list(const char* s, Vec<uint32_t>& x)
+{
+	x.clear();
+	while(*s)
+	{
+		x.push_back(strtol(s,(char**)&s,10));
+		if(','==*s)
+			s++;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t n_doc = 1000, doc_len = 200, n_word = 10000;
+	double zipf = 1.0;
+	uint32_t seed = 0;
+	const char* K_list = "10,100,1000";
+	const char* T_list = "1,10,50";
+	const char* gen = NULL;
+	WordStat::Layout layout = WordStat::DENSE;
+	SimdLevel level = SIMD_AUTO;
+
+	if(0==(argc%2)) {
+		fprintf(stderr," Usage: %s [OPTIONS]\n",argv[0]);
+		fprintf(stderr,"	-ndoc		Number of docs (1000)\n");
+		fprintf(stderr,"	-doclen		Mean doc length (200)\n");
+		fprintf(stderr,"	-nword		Vocabulary size (10000)\n");
+		fprintf(stderr,"	-zipf		Zipf exponent of word frequencies (1.0)\n");
+		fprintf(stderr,"	-K		List of numbers of menus (10,100,1000)\n");
+		fprintf(stderr,"	-T		List of tables per doc (1,10,50)\n");
+		fprintf(stderr,"	-layout		dense, sparse or word (dense)\n");
+		fprintf(stderr,"	-simd		auto, avx512, avx2 or scalar kernels (auto)\n");
+		fprintf(stderr,"	-gen		Only write the corpus to a file (lda-c)\n");
+		fprintf(stderr,"	-seed		Random seed (0)\n");
+		return -1;
+	}
+	for(int i=1;i<argc;i++)
+	{
+		if(0==strcmp(argv[i],"-ndoc"))
+			n_doc = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-doclen"))
+			doc_len = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-nword"))
+			n_word = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-zipf"))
+			zipf = strtod(argv[++i],NULL);
+		else if(0==strcmp(argv[i],"-K"))
+			K_list = argv[++i];
+		else if(0==strcmp(argv[i],"-T"))
+			T_list = argv[++i];
+		else if(0==strcmp(argv[i],"-gen"))
+			gen = argv[++i];
+		else if(0==strcmp(argv[i],"-seed"))
+			seed = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-simd"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"auto"))
+				level = SIMD_AUTO;
+			else if(0==strcmp(argv[i],"avx512"))
+				level = SIMD_AVX512;
+			else if(0==strcmp(argv[i],"avx2"))
+				level = SIMD_AVX2;
+			else if(0==strcmp(argv[i],"scalar"))
+				level = SIMD_SCALAR;
+			else
+				error("Unknown kernels %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-layout"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"dense"))
+				layout = WordStat::DENSE;
+			else if(0==strcmp(argv[i],"sparse"))
+				layout = WordStat::SPARSE;
+			else if(0==strcmp(argv[i],"word"))
+				layout = WordStat::WORD;
+			else
+				error("Unknown layout %s\n",argv[i]);
+		}
+		else
+			error("Unknown option %s\n",argv[i]);
+	}
+	Vec<uint32_t> Ks, Ts;
+	parse_list(K_list,Ks);
+	parse_list(T_list,Ts);
+	lcg64(seed);
+	if(NULL!=gen)
+	{
+		gen_corpus(gen,n_doc,doc_len,n_word,zipf);
+		return 0;
+	}
+	char data[] = "/tmp/hdp_bench_XXXXXX";
+	int fd = mkstemp(data);
+	if(fd<0)
+		error("Cannot create a temporary file.\n");
+	close(fd);
+	gen_corpus(data,n_doc,doc_len,n_word,zipf);
+
+	printf("kernels: %s\n",simd_name(simd_set(level)));
+	printf("%-16s %6s %4s %12s %12s %10s\n","kernel","K","T","ns/item","cycles/item","allocs/item");
+	Timer tm;
+	// Loading
+	Corpus c;
+	tm.start();
+	c.read_text(data,0,n_word,1);
+	tm.report("read_data",0,0,c.n_token);
+	// Small kernels
+	PCT pct(65536*128,log,0.5);
+	{
+		uint32_t n = 1<<22;
+		double s = 0;
+		tm.start();
+		s += pct(65536*128-1); // fills the table
+		tm.report("PCT fill",0,0,65536*128);
+		tm.start();
+		for(uint32_t i=0;i<n;i++)
+			s += pct(lcg64()>>41);
+		tm.report("PCT()",0,0,n);
+		if(s==0)
+			printf("\n");
+	}
+	{
+		uint32_t n = 1<<24;
+		double s = 0;
+		uint64_t r = seed;
+		tm.start();
+		for(uint32_t i=0;i<n;i++)
+			s += drand_r(&r);
+		tm.report("drand lcg64",0,0,n);
+		Rng rng;
+		rng.set(seed,0,0,0);
+		tm.start();
+		for(uint32_t i=0;i<n;i++)
+			s += rng.drand();
+		tm.report("drand philox",0,0,n);
+		Vec<double> u(1024);
+		u.resize(1024);
+		tm.start();
+		for(uint32_t i=0;i<n;i+=1024)
+		{
+			rng.fill(&(u[0]),1024);
+			s += u[i%1024];
+		}
+		tm.report("fill philox",0,0,n);
+		if(s==0)
+			printf("\n");
+	}
+	for(uint32_t j=0;j<Ks.len;j++)
+	{
+		uint32_t K = Ks[j];
+		uint32_t n = (1<<24)/K+1;
+		Vec<double> p(K), q(K), x(K);
+		p.resize(K);
+		q.resize(K);
+		x.resize(K);
+		for(uint32_t k=0;k<K;k++)
+			x[k] = -10*drand();
+		tm.start();
+		for(uint32_t i=0;i<n;i++)
+		{
+			memcpy(&(p[0]),&(x[0]),K*sizeof(double));
+			prop_exp(&(p[0]),K);
+		}
+		tm.report("prop_exp",K,0,(uint64_t)n*K);
+		tm.start();
+		uint64_t s = 0;
+		for(uint32_t i=0;i<n;i++)
+			s += rmultinorm(&(p[0]),&(q[0]),K);
+		tm.report("rmultinorm",K,0,(uint64_t)n*K);
+		if(s==~0ull)
+			printf("\n");
+	}
+	// Sampler kernels on states with K menus and T tables per doc
+	for(uint32_t j=0;j<Ks.len;j++)
+		for(uint32_t l=0;l<Ts.len;l++)
+		{
+			uint32_t K = Ks[j], T = Ts[l];
+			Corpus cc;
+			cc.read_text(data,0,n_word,1);
+			HDP h(cc.n_doc,n_word);
+			h.set_data(cc);
+			h.config(1,0.5,1);
+			h.set_layout(layout);
+			setup(h,K,T);
+			uint64_t n_table = h.menu_stat_sum;
+			tm.start();
+			for(uint32_t d=0;d<h.n_doc;d++)
+				for(uint32_t i=0;i<h.dat[d].len;i++)
+					h.reassign_user(d,i);
+			tm.report("reassign_user",K,T,h.dat.n_token);
+			n_table = h.menu_stat_sum;
+			tm.start();
+			for(uint32_t d=0;d<h.n_doc;d++)
+				for(uint32_t t=0;t<h.menu[d].len;t++)
+					h.reassign_table(d,t);
+			tm.report("reassign_table",K,T,n_table);
+			tm.start();
+			h.remove_empty();
+			tm.report("remove_empty",K,T,n_table);
+		}
+	unlink(data);
+	return 0;
+}
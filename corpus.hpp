@@ -0,0 +1,496 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "vec.hpp"
+#include "qlog.hpp"
+
+/**
+ * Words of one document, pointing into the corpus
+ */
+struct Doc
+{
+	const uint32_t* head;
+	uint32_t len;
+
+	uint32_t operator[](uint32_t i) const { return head[i]; }
+};
+
+/**
+ * Tokens of all documents in a flat array, doc d being
+ * token[offset[d]],...,token[offset[d+1]-1].
+ *
+ * Binary format (little endian, native layout):
+ *   uint32_t magic, version, n_doc, n_word
+ *   uint64_t n_token
+ *   uint64_t offset[n_doc+1]
+ *   uint32_t token[n_token]
+ * which can be mmap()ed and used in place.
+ */
+class Corpus
+{
+public:
+	enum { MAGIC = 0x43504448u, VERSION = 1 }; // "HDPC"
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t n_doc;
+		uint32_t n_word;
+		uint64_t n_token;
+	};
+
+	uint32_t n_doc;
+	uint32_t n_word;
+	uint64_t n_token;
+	uint64_t* offset;
+	uint32_t* token;
+
+	uint64_t max_token; // capacity of token when owned
+	uint32_t last; // doc of the last add_entry()
+	void* map; // mmap()ed file, NULL if arrays are owned
+	size_t map_len;
+
+	Corpus(): n_doc(0), n_word(0), n_token(0), offset(NULL), token(NULL),
+		max_token(0), last(0), map(NULL), map_len(0) {}
+
+	~Corpus() { dtor(); }
+
+	void dtor()
+	{
+		if(NULL!=map)
+			munmap(map,map_len);
+		else
+		{
+			free(offset);
+			free(token);
+		}
+		map = NULL;
+		offset = NULL;
+		token = NULL;
+		n_doc = n_token = max_token = last = 0;
+	}
+
+	Doc operator[](uint32_t d) const
+	{
+		Doc doc = {token+offset[d],(uint32_t)(offset[d+1]-offset[d])};
+		return doc;
+	}
+
+	// Empty corpus of n_doc documents, filled by add_entry()
+	void init(uint32_t _n_doc, uint32_t _n_word)
+	{
+		dtor();
+		n_doc = _n_doc;
+		n_word = _n_word;
+		qassert((offset=(uint64_t*)malloc((n_doc+1)*sizeof(uint64_t))));
+		memset(offset,0,(n_doc+1)*sizeof(uint64_t));
+	}
+
+	// Append a word to doc, docs must be added in order
+	void add_entry(uint32_t doc, uint32_t word)
+	{
+		qassert(NULL==map);
+		qassert(doc<n_doc);
+		qassert(word<n_word);
+		qassert(doc>=last);
+		for(;last<doc;last++)
+			offset[last+1] = n_token;
+		if(n_token==max_token)
+		{
+			max_token = 1024>2*max_token?1024:2*max_token;
+			qassert((token=(uint32_t*)realloc(token,max_token*sizeof(uint32_t))));
+		}
+		token[n_token++] = word;
+		offset[doc+1] = n_token;
+	}
+
+	/**
+	 * Part of an lda-c file parsed by one thread
+	 */
+	struct Chunk
+	{
+		const char* begin; // at a line start
+		const char* end;
+		uint32_t* token;
+		uint64_t n_token;
+		uint64_t max_token;
+		Vec<uint32_t> doc_len;
+		uint32_t max_word;
+		const char* bad; // where parsing failed, NULL if ok
+		uint64_t dst; // offset of the tokens in the corpus
+		Corpus* c;
+	};
+
+	// Skip blanks, then read an unsigned integer, NULL if none
+	static inline const char* parse_uint(const char* p, const char* end, uint32_t* x)
+	{
+		while(p<end and (' '==*p or '\t'==*p))
+			p++;
+		if(p==end or (unsigned)(*p-'0')>9)
+			return NULL;
+		uint64_t v = 0;
+		while(p<end and (unsigned)(*p-'0')<=9)
+		{
+			v = v*10+(*p-'0');
+			if(v>0xffffffffu)
+				return NULL;
+			p++;
+		}
+		*x = v;
+		return p;
+	}
+
+	static void* parse_chunk(void* arg)
+	{
+		Chunk& ck = *(Chunk*)arg;
+		const char* p = ck.begin;
+		while(p<ck.end)
+		{
+			const char* line = p;
+			uint32_t n,w,m,len=0;
+			while(p<ck.end and (' '==*p or '\t'==*p or '\r'==*p))
+				p++;
+			if(p<ck.end and '\n'==*p) // blank line
+			{
+				p++;
+				continue;
+			}
+			if(p==ck.end)
+				break;
+			if(NULL==(p=parse_uint(p,ck.end,&n)))
+			{
+				ck.bad = line;
+				return NULL;
+			}
+			for(uint32_t i=0;i<n;i++)
+			{
+				if(NULL==(p=parse_uint(p,ck.end,&w)) or p==ck.end or ':'!=*p
+						or NULL==(p=parse_uint(p+1,ck.end,&m)))
+				{
+					ck.bad = line;
+					return NULL;
+				}
+				if(ck.n_token+m>ck.max_token)
+				{
+					ck.max_token = 2*ck.max_token>ck.n_token+m?2*ck.max_token:ck.n_token+m;
+					qassert((ck.token=(uint32_t*)realloc(ck.token,ck.max_token*sizeof(uint32_t))));
+				}
+				for(uint32_t j=0;j<m;j++)
+					ck.token[ck.n_token++] = w;
+				if(w>ck.max_word)
+					ck.max_word = w;
+				len += m;
+			}
+			while(p<ck.end and (' '==*p or '\t'==*p or '\r'==*p))
+				p++;
+			if(p<ck.end and '\n'!=*p)
+			{
+				ck.bad = line;
+				return NULL;
+			}
+			p++;
+			ck.doc_len.push_back(len);
+		}
+		return NULL;
+	}
+
+	static void* copy_chunk(void* arg)
+	{
+		Chunk& ck = *(Chunk*)arg;
+		if(ck.n_token>0)
+			memcpy(ck.c->token+ck.dst,ck.token,ck.n_token*sizeof(uint32_t));
+		return NULL;
+	}
+
+	/**
+	 * Read an lda-c file with n_thread threads, each parsing a range of
+	 * lines. The number of docs and words are found from the data; if
+	 * _n_doc>0 only the first _n_doc docs are kept, if _n_word>0 word
+	 * ids must be less than it.
+	 */
+	void read_text(const char* filename, uint32_t _n_doc, uint32_t _n_word,
+			uint32_t n_thread)
+	{
+		dtor();
+		int fd = open(filename,O_RDONLY);
+		if(fd<0)
+			error("Cannot open %s for reading.\n",filename);
+		struct stat st;
+		qassert(0==fstat(fd,&st));
+		size_t size = st.st_size;
+		const char* text = NULL;
+		if(size>0)
+		{
+			text = (const char*)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+			if(MAP_FAILED==(void*)text)
+				error("Cannot mmap %s\n",filename);
+			madvise((void*)text,size,MADV_SEQUENTIAL);
+		}
+		close(fd);
+		if(0==n_thread)
+			n_thread = 1;
+		if(n_thread>size/65536+1) // not worth a thread
+			n_thread = size/65536+1;
+		// Split into ranges of lines
+		Chunk* ck = new Chunk[n_thread];
+		const char* p = text;
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			ck[j].begin = p;
+			p = (j==n_thread-1)?text+size:text+size/n_thread*(j+1);
+			if(p<ck[j].begin)
+				p = ck[j].begin;
+			while(p<text+size and '\n'!=p[-1])
+				p++;
+			ck[j].end = p;
+			ck[j].token = NULL;
+			ck[j].n_token = ck[j].max_token = 0;
+			ck[j].max_word = 0;
+			ck[j].bad = NULL;
+			ck[j].c = this;
+		}
+		run_chunks(ck,n_thread,parse_chunk);
+		// Doc offsets and size of vocabulary
+		uint32_t found = 0, max_word = 0;
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			if(NULL!=ck[j].bad)
+			{
+				const char* q = ck[j].bad;
+				while(q<text+size and '\n'!=*q)
+					q++;
+				error("%s: cannot parse line at byte %lu: %.*s\n",filename,
+						(unsigned long)(ck[j].bad-text),(int)(q-ck[j].bad),ck[j].bad);
+			}
+			found += ck[j].doc_len.len;
+			if(ck[j].max_word>max_word)
+				max_word = ck[j].max_word;
+		}
+		if(_n_doc>found)
+			error("%s has %u docs, less than %u\n",filename,found,_n_doc);
+		n_doc = (_n_doc>0)?_n_doc:found;
+		n_word = (_n_word>0)?_n_word:max_word+1;
+		qassert((offset=(uint64_t*)malloc((n_doc+1)*sizeof(uint64_t))));
+		offset[0] = 0;
+		uint32_t d = 0;
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			ck[j].dst = offset[d];
+			for(uint32_t i=0;i<ck[j].doc_len.len and d<n_doc;i++,d++)
+				offset[d+1] = offset[d]+ck[j].doc_len[i];
+		}
+		n_token = offset[n_doc];
+		max_token = n_token;
+		qassert((token=(uint32_t*)malloc((n_token>0?n_token:1)*sizeof(uint32_t))));
+		// Chunks of dropped docs are cut
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			if(ck[j].dst>n_token)
+				ck[j].dst = n_token;
+			if(ck[j].dst+ck[j].n_token>n_token)
+				ck[j].n_token = n_token-ck[j].dst;
+		}
+		run_chunks(ck,n_thread,copy_chunk);
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			free(ck[j].token);
+			ck[j].doc_len.dtor();
+		}
+		delete[] ck;
+		if(size>0)
+			munmap((void*)text,size);
+		last = n_doc>0?n_doc-1:0;
+		if(_n_word>0 and max_word>=_n_word)
+			for(uint64_t i=0;i<n_token;i++)
+				if(token[i]>=n_word)
+					error("%s: word %u out of range\n",filename,token[i]);
+	}
+
+	// Run f on each chunk by a thread
+	static void run_chunks(Chunk* ck, uint32_t n, void* (*f)(void*))
+	{
+		if(1==n)
+		{
+			f(&ck[0]);
+			return;
+		}
+		pthread_t* th = (pthread_t*)malloc(n*sizeof(pthread_t));
+		for(uint32_t j=0;j<n;j++)
+			if(pthread_create(&th[j],NULL,f,&ck[j]))
+				error("Cannot create thread %u.\n",j);
+		for(uint32_t j=0;j<n;j++)
+			pthread_join(th[j],NULL);
+		free(th);
+	}
+
+	// Read a corpus in binary or lda-c format
+	void load(const char* filename, uint32_t _n_doc, uint32_t _n_word,
+			uint32_t n_thread)
+	{
+		Header h;
+		if(!read_header(filename,&h))
+		{
+			read_text(filename,_n_doc,_n_word,n_thread);
+			return;
+		}
+		map_binary(filename);
+		// As with lda-c: docs after the first _n_doc are dropped, word
+		// ids checked against _n_word
+		if(_n_doc>n_doc)
+			error("%s has %u docs, less than %u\n",filename,n_doc,_n_doc);
+		if(_n_doc>0)
+		{
+			n_doc = _n_doc;
+			n_token = offset[n_doc];
+		}
+		if(_n_word>0)
+		{
+			bool narrower = _n_word<n_word;
+			n_word = _n_word;
+			if(narrower)
+				check_words(filename);
+		}
+	}
+
+	// Append the docs of c, the result is owned (not mapped)
+	void append(const Corpus& c)
+	{
+		uint32_t nd = n_doc+c.n_doc;
+		uint64_t nt = n_token+c.n_token;
+		uint64_t* o;
+		uint32_t* x;
+		qassert((o=(uint64_t*)malloc((nd+1)*sizeof(uint64_t))));
+		qassert((x=(uint32_t*)malloc((nt>0?nt:1)*sizeof(uint32_t))));
+		o[0] = 0;
+		if(n_doc>0)
+			memcpy(o,offset,(n_doc+1)*sizeof(uint64_t));
+		for(uint32_t d=0;d<c.n_doc;d++)
+			o[n_doc+d+1] = n_token+c.offset[d+1];
+		if(n_token>0)
+			memcpy(x,token,n_token*sizeof(uint32_t));
+		if(c.n_token>0)
+			memcpy(x+n_token,c.token,c.n_token*sizeof(uint32_t));
+		uint32_t nw = n_word>c.n_word?n_word:c.n_word;
+		dtor();
+		offset = o;
+		token = x;
+		n_doc = nd;
+		n_word = nw;
+		n_token = max_token = nt;
+		last = nd>0?nd-1:0;
+	}
+
+	// Keep docs begin,...,end-1 only, the result is owned (not mapped)
+	void keep(uint32_t begin, uint32_t end)
+	{
+		qassert(begin<=end and end<=n_doc);
+		uint32_t nd = end-begin;
+		uint64_t nt = offset[end]-offset[begin];
+		uint64_t* o;
+		uint32_t* x;
+		qassert((o=(uint64_t*)malloc((nd+1)*sizeof(uint64_t))));
+		qassert((x=(uint32_t*)malloc((nt>0?nt:1)*sizeof(uint32_t))));
+		for(uint32_t d=0;d<=nd;d++)
+			o[d] = offset[begin+d]-offset[begin];
+		if(nt>0)
+			memcpy(x,token+offset[begin],nt*sizeof(uint32_t));
+		uint32_t nw = n_word;
+		dtor();
+		offset = o;
+		token = x;
+		n_doc = nd;
+		n_word = nw;
+		n_token = max_token = nt;
+		last = nd>0?nd-1:0;
+	}
+
+	// Exchange contents with c
+	void swap(Corpus& c)
+	{
+		char tmp[sizeof(Corpus)];
+		memcpy(tmp,(void*)this,sizeof(Corpus));
+		memcpy((void*)this,(void*)&c,sizeof(Corpus));
+		memcpy((void*)&c,tmp,sizeof(Corpus));
+	}
+
+	void write_binary(const char* filename)
+	{
+		FILE * f = fopen(filename,"wb");
+		if(!f)
+			error("Cannot open %s for writing.\n",filename);
+		Header h = {MAGIC,VERSION,n_doc,n_word,n_token};
+		qassert(1==fwrite(&h,sizeof(Header),1,f));
+		qassert(n_doc+1==fwrite(offset,sizeof(uint64_t),n_doc+1,f));
+		qassert(n_token==fwrite(token,sizeof(uint32_t),n_token,f));
+		qassert(0==fclose(f));
+	}
+
+	// Read the header of a binary corpus, false if not one
+	static bool read_header(const char* filename, Header* h)
+	{
+		FILE * f = fopen(filename,"rb");
+		if(!f)
+			error("Cannot open %s for reading.\n",filename);
+		bool ok = (1==fread(h,sizeof(Header),1,f) and MAGIC==h->magic);
+		fclose(f);
+		if(ok and VERSION!=h->version)
+			error("%s: unsupported corpus version %u\n",filename,h->version);
+		return ok;
+	}
+
+	// Map a binary corpus, its arrays are used in place
+	void map_binary(const char* filename)
+	{
+		dtor();
+		int fd = open(filename,O_RDONLY);
+		if(fd<0)
+			error("Cannot open %s for reading.\n",filename);
+		struct stat st;
+		qassert(0==fstat(fd,&st));
+		map_len = st.st_size;
+		if(map_len<sizeof(Header))
+			error("%s: not a binary corpus\n",filename);
+		map = mmap(NULL,map_len,PROT_READ,MAP_PRIVATE,fd,0);
+		close(fd);
+		if(MAP_FAILED==map)
+		{
+			map = NULL;
+			error("Cannot mmap %s\n",filename);
+		}
+		const Header* h = (const Header*)map;
+		if(MAGIC!=h->magic or VERSION!=h->version)
+			error("%s: not a binary corpus of version %u\n",filename,VERSION);
+		n_doc = h->n_doc;
+		n_word = h->n_word;
+		n_token = h->n_token;
+		if(map_len!=sizeof(Header)+(n_doc+1)*sizeof(uint64_t)+n_token*sizeof(uint32_t))
+			error("%s: truncated binary corpus\n",filename);
+		offset = (uint64_t*)((char*)map+sizeof(Header));
+		token = (uint32_t*)(offset+n_doc+1);
+		for(uint32_t d=0;d<n_doc;d++)
+			if(offset[d]>offset[d+1])
+				error("%s: bad offset of doc %u\n",filename,d);
+		if(0!=offset[0] or n_token!=offset[n_doc])
+			error("%s: bad offsets\n",filename);
+		madvise(map,map_len,MADV_WILLNEED);
+		check_words(filename);
+	}
+
+	// Error if a word id is not below n_word
+	void check_words(const char* filename)
+	{
+		for(uint64_t i=0;i<n_token;i++)
+			if(token[i]>=n_word)
+				error("%s: word %u out of range\n",filename,token[i]);
+	}
+};
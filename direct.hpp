@@ -0,0 +1,324 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include "vec.hpp"
+#include "rng.hpp"
+#include "wordstat.hpp"
+#include "corpus.hpp"
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * HDP in direct assignment representation (Teh et al., 2006, 5.3):
+ * a menu per token instead of a table, global weights b_k of the menus
+ * (b_u for all new ones) and table counts m_k drawn as auxiliary
+ * variables in each sweep:
+ *   p(z_di=k)   ~ (n_dk+alpha*b_k)*(n_kw+beta)/(n_k+beta*n_word)
+ *   p(z_di=new) ~ alpha*b_u/n_word, then b_new = v*b_u, v ~ Beta(1,gamma)
+ *   m_dk = sum_{j<n_dk} [u_j < alpha*b_k/(alpha*b_k+j)]
+ *   (b_1,...,b_K,b_u) ~ Dir(m_1,...,m_K,gamma)
+ * Topics are word_stat of the Model as with HDP and menu_stat holds
+ * m_k, so that output and metrics read both alike.
+ * A token keeps only its menu; the counts n_dk of a doc are rebuilt in
+ * a scratch array when it is sampled, and its m_dk drawn right after
+ * (b_k of the menus of the doc does not change in the rest of the sweep).
+ */
+class Direct : public Model
+{
+public:
+	const uint32_t n_doc;
+	const uint32_t n_word;
+
+	double alpha;
+	double beta;
+	double gamma;
+
+	Corpus dat;
+	uint32_t* z; // menu of word i of doc d at z[dat.offset[d]+i]
+	Vec<double> b; // weight of menu k, b[n_menu] that of new menus
+	Vec<uint32_t> order; // shuffled doc list
+
+	// Random numbers of doc d in a sweep come from stream
+	// (d,n_sweep,kind) of seed, the weights from (~0,n_sweep,RNG_WEIGHT)
+	enum RngKind { RNG_INIT, RNG_SWEEP, RNG_WEIGHT };
+	uint64_t seed;
+	uint64_t n_sweep;
+	Rng rng;
+
+	// Scratch of a doc
+	Vec<uint32_t> doc_cnt; // n_dk, 0 for menus not in the doc
+	Vec<double> inv; // 1/(word_stat_sum[k]+beta*n_word)
+	Vec<double> p; // prob without normalization
+	Vec<double> q; // cum prob
+
+	Direct(uint32_t _n_doc, uint32_t _n_word):
+		n_doc(_n_doc), n_word(_n_word), alpha(1), beta(0.5), gamma(1), z(NULL)
+	{
+		dat.init(n_doc,n_word);
+		word_stat.init(n_word,WordStat::DENSE);
+		b.push_back(1);
+		for(uint32_t d=0;d<n_doc;d++)
+			order.push_back(d);
+		seed = 0;
+		n_sweep = 0;
+	}
+
+	~Direct() { dtor(); }
+
+	void dtor()
+	{
+		free(z);
+		z = NULL;
+		dat.dtor();
+		Model::dtor();
+	}
+
+	// Storage of topic-word counts, to be set before init()
+	void set_layout(WordStat::Layout layout)
+	{
+		qassert(word_stat.len==0);
+		word_stat.init(n_word,layout);
+	}
+
+	void config(double _alpha, double _beta, double _gamma)
+	{
+		alpha = _alpha;
+		beta = _beta;
+		gamma = _gamma;
+	}
+
+	// Use the docs of c (which is left empty)
+	void set_data(Corpus& c)
+	{
+		qassert(c.n_doc==n_doc and c.n_word==n_word);
+		dat.swap(c);
+		c.dtor();
+		free(z);
+		qassert((z=(uint32_t*)malloc((dat.n_token>0?dat.n_token:1)*sizeof(uint32_t))));
+	}
+
+	// Seat the words one after another, as they come
+	void init()
+	{
+		qassert(0==menu_stat.len);
+		shuffle(&(order[0]),n_doc);
+		sweep(true);
+	}
+
+	// One sweep over all docs, then the weights
+	void gibbs()
+	{
+		n_sweep++;
+		shuffle(&(order[0]),n_doc);
+		sweep(false);
+	}
+
+	/**
+	 * Joint log-likelihood of the words and their menus given b: words
+	 * given menus (Dirichlet-multinomial per menu) and menus of the
+	 * words of a doc (Dirichlet-multinomial with alpha*b).
+	 */
+	double loglik()
+	{
+		double s = word_loglik(beta);
+		uint32_t n_menu = menu_stat.len;
+		Vec<uint32_t> cnt(n_menu>0?n_menu:1);
+		cnt.resize(n_menu);
+		if(n_menu>0)
+			memset(&(cnt[0]),0,n_menu*sizeof(uint32_t));
+		for(uint32_t d=0;d<n_doc;d++)
+		{
+			uint32_t len = dat[d].len;
+			const uint32_t* zd = z+dat.offset[d];
+			for(uint32_t i=0;i<len;i++)
+				cnt[zd[i]]++;
+			for(uint32_t i=0;i<len;i++)
+			{
+				uint32_t k = zd[i];
+				if(0==cnt[k])
+					continue;
+				s += lgamma(alpha*b[k]+cnt[k])-lgamma(alpha*b[k]);
+				cnt[k] = 0;
+			}
+			s += lgamma(alpha)-lgamma(alpha+len);
+		}
+		return s;
+	}
+
+	// Add the words of doc d per menu to cnt (n_menu long), pushing to
+	// id the menus whose count was 0
+	void doc_menus(uint32_t d, Vec<uint32_t>& cnt, Vec<uint32_t>& id)
+	{
+		uint32_t len = dat[d].len;
+		const uint32_t* zd = z+dat.offset[d];
+		for(uint32_t i=0;i<len;i++)
+		{
+			if(0==cnt[zd[i]])
+				id.push_back(zd[i]);
+			cnt[zd[i]]++;
+		}
+	}
+
+	// Sum of word_stat and menu_stat over the tokens (for tests)
+	void check()
+	{
+		uint32_t n_menu = menu_stat.len;
+		qassert(b.len==n_menu+1 and word_stat.len==n_menu);
+		Vec<uint32_t> n(n_menu>0?n_menu:1);
+		n.resize(n_menu);
+		if(n_menu>0)
+			memset(&(n[0]),0,n_menu*sizeof(uint32_t));
+		for(uint64_t i=0;i<dat.n_token;i++)
+		{
+			qassert(z[i]<n_menu);
+			n[z[i]]++;
+		}
+		uint32_t m = 0;
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			qassert(n[k]==word_stat_sum[k] and n[k]>0);
+			qassert(menu_stat[k]>0 and menu_stat[k]<=n[k]);
+			m += menu_stat[k];
+		}
+		qassert(m==menu_stat_sum);
+	}
+
+private:
+	// Tokens and tables of all docs, then empty menus and the weights
+	void sweep(bool firstrun)
+	{
+		uint32_t n_menu = menu_stat.len;
+		doc_cnt.resize(n_menu);
+		inv.resize(n_menu);
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			doc_cnt[k] = 0;
+			inv[k] = 1/(word_stat_sum[k]+beta*n_word);
+			menu_stat[k] = 0;
+		}
+		menu_stat_sum = 0;
+		for(uint32_t j=0;j<n_doc;j++)
+		{
+			uint32_t d = order[j];
+			rng.set(seed,d,(uint32_t)n_sweep,firstrun?RNG_INIT:RNG_SWEEP);
+			sample_doc(d,firstrun);
+			sample_tables(d);
+		}
+		remove_empty();
+		sample_weights();
+	}
+
+	// Menus of the words of doc d (not seated yet if firstrun)
+	void sample_doc(uint32_t d, bool firstrun)
+	{
+		uint32_t len = dat[d].len;
+		const uint32_t* w = dat[d].head;
+		uint32_t* zd = z+dat.offset[d];
+		for(uint32_t i=0;i<len and not firstrun;i++)
+			doc_cnt[zd[i]]++;
+		for(uint32_t i=0;i<len;i++)
+		{
+			uint32_t k;
+			if(not firstrun)
+			{
+				k = zd[i];
+				doc_cnt[k]--;
+				word_stat.dec(k,w[i]);
+				inv[k] = 1/(--word_stat_sum[k]+beta*n_word);
+			}
+			uint32_t n_menu = menu_stat.len;
+			p.resize(n_menu+1);
+			q.resize(n_menu+1);
+			uint32_t* col = word_stat.column(w[i]); // sequential scan if word-major
+			for(k=0;k<n_menu;k++)
+			{
+				uint32_t n_kw = (NULL!=col)?col[k]:word_stat.get(k,w[i]);
+				p[k] = (doc_cnt[k]+alpha*b[k])*(n_kw+beta)*inv[k];
+			}
+			p[n_menu] = alpha*b[n_menu]/n_word;
+			k = rmultinorm_r(&rng,&(p[0]),&(q[0]),n_menu+1);
+			if(k==n_menu)
+				add_menu();
+			zd[i] = k;
+			doc_cnt[k]++;
+			word_stat.inc(k,w[i]);
+			inv[k] = 1/(++word_stat_sum[k]+beta*n_word);
+		}
+	}
+
+	// A new menu, with its share v~Beta(1,gamma) of b_u
+	void add_menu()
+	{
+		uint32_t k = Model::add_menu();
+		doc_cnt.push_back(0);
+		inv.push_back(1/(beta*n_word));
+		double v = 1-pow(rng.drand(),1/gamma);
+		double bu = b[k];
+		b[k] = v*bu;
+		b.push_back((1-v)*bu);
+	}
+
+	// Tables of doc d at each of its menus, doc_cnt is cleared
+	void sample_tables(uint32_t d)
+	{
+		uint32_t len = dat[d].len;
+		const uint32_t* zd = z+dat.offset[d];
+		for(uint32_t i=0;i<len;i++)
+		{
+			uint32_t k = zd[i];
+			uint32_t n = doc_cnt[k];
+			if(0==n)
+				continue;
+			double ab = alpha*b[k];
+			uint32_t m = 1; // the first word opens a table
+			for(uint32_t j=1;j<n;j++)
+				if(rng.drand()*(ab+j)<ab)
+					m++;
+			menu_stat[k] += m;
+			menu_stat_sum += m;
+			doc_cnt[k] = 0;
+		}
+	}
+
+	// Menus without tables (so without words) removed, as HDP
+	void remove_empty()
+	{
+		Vec<uint32_t> src;
+		uint32_t len = menu_src(src);
+		if(len==src.len)
+			return;
+		Vec<uint32_t> remap(src.len);
+		remap.resize(src.len);
+		for(uint32_t j=0;j<len;j++)
+			remap[src[j]] = j;
+		for(uint64_t i=0;i<dat.n_token;i++)
+			z[i] = remap[z[i]];
+		compact(src,len);
+		for(uint32_t j=0;j<len;j++) // src[j]>=j
+		{
+			b[j] = b[src[j]];
+			inv[j] = inv[src[j]];
+		}
+		b[len] = b[src.len];
+		b.len = len+1;
+		inv.len = len;
+		doc_cnt.len = len;
+	}
+
+	// (b_1,...,b_K,b_u) ~ Dir(m_1,...,m_K,gamma)
+	void sample_weights()
+	{
+		rng.set(seed,~0u,(uint32_t)n_sweep,RNG_WEIGHT);
+		uint32_t n_menu = menu_stat.len;
+		double s = 0;
+		for(uint32_t k=0;k<n_menu;k++)
+			s += (b[k]=rgamma_r(&rng,menu_stat[k]));
+		s += (b[n_menu]=rgamma_r(&rng,gamma));
+		for(uint32_t k=0;k<=n_menu;k++)
+			b[k] /= s;
+	}
+};
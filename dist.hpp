@@ -0,0 +1,549 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "vec.hpp"
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * Training over several processes: a server holds the franchise (Model),
+ * worker r of N samples docs [n_doc*r/N, n_doc*(r+1)/N) of the corpus
+ * against its own copy of it. Each phase (init, gibbs_table, gibbs_menu)
+ * of a worker ends with a sync:
+ *   worker -> server: its changes since the last sync, sparse:
+ *     (k,w,n) of word_stat (word_stat_sum follows), (k,n) of menu_stat,
+ *     and its number of new menus (local ids from the count at the sync)
+ *   server, once all workers sent: new menus of worker j take the ids
+ *     after those of workers before j, all changes are added and empty
+ *     menus removed (as remove_empty())
+ *   server -> worker: the first id of its new menus, the sum of the
+ *     changes of all workers (in global ids) and the compaction (src of
+ *     menu_src() when menus were removed)
+ * so that all processes have the same Model after a sync, whatever the
+ * timing. Addresses are "unix:PATH" or "HOST:PORT".
+ */
+
+// Change of menu_stat[k]
+struct MenuDelta
+{
+	uint32_t k;
+	int32_t n;
+};
+
+// Sum the changes of the same (k,w), dropping those summing to 0
+inline void sum_deltas(Vec<Delta>& x)
+{
+	if(x.len==0)
+		return;
+	qsort(&(x[0]),x.len,sizeof(Delta),cmp_delta);
+	uint32_t n = 0;
+	for(uint32_t i=0;i<x.len;i++)
+	{
+		if(n>0 and x[n-1].k==x[i].k and x[n-1].w==x[i].w)
+			x[n-1].n += x[i].n;
+		else
+			x[n++] = x[i];
+		if(n>0 and 0==x[n-1].n)
+			n--;
+	}
+	x.len = n;
+}
+
+// Add changes to m, without journal
+inline void add_deltas(Model& m, const Vec<Delta>& ws, const Vec<MenuDelta>& ms)
+{
+	Journal* journal = m.word_stat.journal;
+	m.word_stat.journal = NULL;
+	for(uint32_t i=0;i<ws.len;i++)
+	{
+		m.word_stat.add(ws[i].k,ws[i].w,ws[i].n);
+		m.word_stat_sum[ws[i].k] += ws[i].n;
+	}
+	for(uint32_t i=0;i<ms.len;i++)
+	{
+		m.menu_stat[ms[i].k] += ms[i].n;
+		m.menu_stat_sum += ms[i].n;
+	}
+	m.word_stat.journal = journal;
+}
+
+/**
+ * Messages: uint64_t number of words, then the uint32_t words
+ */
+class Link
+{
+public:
+	int fd;
+
+	Link(): fd(-1) {}
+
+	~Link() { close(); }
+
+	void close()
+	{
+		if(fd>=0)
+			::close(fd);
+		fd = -1;
+	}
+
+	// Socket bound to addr and listening, or -1
+	static int listen_at(const char* addr)
+	{
+		int s = open_addr(addr,true);
+		if(s>=0 and ::listen(s,64)<0)
+		{
+			::close(s);
+			return -1;
+		}
+		return s;
+	}
+
+	// Connect to addr, trying for about timeout seconds
+	void connect_to(const char* addr, uint32_t timeout)
+	{
+		for(uint32_t i=0;i<10*timeout and fd<0;i++)
+			if((fd=open_addr(addr,false))<0)
+				usleep(100000);
+		if(fd<0)
+			error("Cannot connect to %s\n",addr);
+	}
+
+	void send(const Vec<uint32_t>& x)
+	{
+		uint64_t n = x.len;
+		write_all(&n,sizeof(n));
+		if(n>0)
+			write_all(x.head,n*sizeof(uint32_t));
+	}
+
+	// false if the peer closed the link before a message
+	bool recv(Vec<uint32_t>& x)
+	{
+		uint64_t n;
+		if(!read_all(&n,sizeof(n),true))
+			return false;
+		if(n>0xffffffffu)
+			error("Message of %lu words\n",(unsigned long)n);
+		x.resize(n);
+		if(n>0)
+			read_all(x.head,n*sizeof(uint32_t),false);
+		return true;
+	}
+
+private:
+	static int open_addr(const char* addr, bool server)
+	{
+		if(0==strncmp(addr,"unix:",5))
+		{
+			struct sockaddr_un a;
+			memset(&a,0,sizeof(a));
+			a.sun_family = AF_UNIX;
+			if(strlen(addr+5)>=sizeof(a.sun_path))
+				error("Socket path too long: %s\n",addr+5);
+			strcpy(a.sun_path,addr+5);
+			int s = socket(AF_UNIX,SOCK_STREAM,0);
+			if(s<0)
+				return -1;
+			if(server)
+				unlink(a.sun_path);
+			int r = server?bind(s,(struct sockaddr*)&a,sizeof(a)):connect(s,(struct sockaddr*)&a,sizeof(a));
+			if(r<0)
+			{
+				::close(s);
+				return -1;
+			}
+			return s;
+		}
+		char host[256];
+		const char* colon = strrchr(addr,':');
+		if(NULL==colon or (size_t)(colon-addr)>=sizeof(host))
+			error("Bad address %s (unix:PATH or HOST:PORT)\n",addr);
+		memcpy(host,addr,colon-addr);
+		host[colon-addr] = 0;
+		struct addrinfo hint, *res;
+		memset(&hint,0,sizeof(hint));
+		hint.ai_family = AF_UNSPEC;
+		hint.ai_socktype = SOCK_STREAM;
+		hint.ai_flags = server?AI_PASSIVE:0;
+		if(getaddrinfo(host[0]?host:NULL,colon+1,&hint,&res))
+			error("Cannot resolve %s\n",addr);
+		int s = -1;
+		for(struct addrinfo* p=res;NULL!=p and s<0;p=p->ai_next)
+		{
+			if((s=socket(p->ai_family,p->ai_socktype,p->ai_protocol))<0)
+				continue;
+			int one = 1;
+			setsockopt(s,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+			if(server)
+				setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+			int r = server?bind(s,p->ai_addr,p->ai_addrlen):connect(s,p->ai_addr,p->ai_addrlen);
+			if(r<0)
+			{
+				::close(s);
+				s = -1;
+			}
+		}
+		freeaddrinfo(res);
+		return s;
+	}
+
+	void write_all(const void* x, uint64_t n)
+	{
+		const char* p = (const char*)x;
+		while(n>0)
+		{
+			ssize_t r = ::send(fd,p,n,MSG_NOSIGNAL);
+			if(r<0 and EINTR==errno)
+				continue;
+			if(r<=0)
+				error("Cannot send: %s\n",strerror(errno));
+			p += r;
+			n -= r;
+		}
+	}
+
+	// false on end of stream before any byte if eof_ok
+	bool read_all(void* x, uint64_t n, bool eof_ok)
+	{
+		char* p = (char*)x;
+		uint64_t got = 0;
+		while(got<n)
+		{
+			ssize_t r = ::recv(fd,p+got,n-got,0);
+			if(r<0 and EINTR==errno)
+				continue;
+			if(0==r and 0==got and eof_ok)
+				return false;
+			if(r<=0)
+				error("Connection lost\n");
+			got += r;
+		}
+		return true;
+	}
+};
+
+// Reads words of a message, failing past its end
+struct MsgReader
+{
+	const Vec<uint32_t>& x;
+	uint32_t pos;
+
+	MsgReader(const Vec<uint32_t>& _x): x(_x), pos(0) {}
+
+	uint32_t get()
+	{
+		if(pos>=x.len)
+			error("Truncated message\n");
+		return x[pos++];
+	}
+
+	// n (k,w,n) with k<n_menu
+	void get_deltas(Vec<Delta>& d, uint32_t n_menu)
+	{
+		uint32_t n = get();
+		for(uint32_t i=0;i<n;i++)
+		{
+			Delta dl;
+			dl.k = get();
+			dl.w = get();
+			dl.n = (int32_t)get();
+			if(dl.k>=n_menu)
+				error("Bad menu %u in message\n",dl.k);
+			d.push_back(dl);
+		}
+	}
+
+	void get_menu_deltas(Vec<MenuDelta>& d, uint32_t n_menu)
+	{
+		uint32_t n = get();
+		for(uint32_t i=0;i<n;i++)
+		{
+			MenuDelta dl;
+			dl.k = get();
+			dl.n = (int32_t)get();
+			if(dl.k>=n_menu)
+				error("Bad menu %u in message\n",dl.k);
+			d.push_back(dl);
+		}
+	}
+};
+
+inline void put_deltas(Vec<uint32_t>& x, const Vec<Delta>& d)
+{
+	x.push_back(d.len);
+	for(uint32_t i=0;i<d.len;i++)
+	{
+		x.push_back(d[i].k);
+		x.push_back(d[i].w);
+		x.push_back((uint32_t)d[i].n);
+	}
+}
+
+inline void put_menu_deltas(Vec<uint32_t>& x, const Vec<MenuDelta>& d)
+{
+	x.push_back(d.len);
+	for(uint32_t i=0;i<d.len;i++)
+	{
+		x.push_back(d[i].k);
+		x.push_back((uint32_t)d[i].n);
+	}
+}
+
+/**
+ * Server: waits for the n_rank workers, then runs syncs until they
+ * all close their link.
+ */
+class ParamServer
+{
+public:
+	enum { HELLO = 0x44504848u }; // "HHPD"
+
+	Model m;
+	uint32_t n_rank;
+	Link* link; // of worker r
+	uint32_t n_sync;
+	uint32_t verbosity;
+
+	ParamServer(): n_rank(0), link(NULL), n_sync(0), verbosity(1) {}
+
+	~ParamServer() { delete[] link; }
+
+	// Hello of a worker: HELLO, rank, n_rank, n_word
+	void run(const char* addr, uint32_t _n_rank, WordStat::Layout layout)
+	{
+		n_rank = _n_rank;
+		qassert(n_rank>0);
+		int s = Link::listen_at(addr);
+		if(s<0)
+			error("Cannot listen at %s\n",addr);
+		delete[] link;
+		link = new Link[n_rank];
+		uint32_t n_word = 0;
+		Vec<uint32_t> msg;
+		for(uint32_t j=0;j<n_rank;j++)
+		{
+			Link l;
+			if((l.fd=accept(s,NULL,NULL))<0)
+				error("Cannot accept: %s\n",strerror(errno));
+			if(!l.recv(msg) or msg.len!=4 or msg[0]!=HELLO or msg[2]!=n_rank)
+				error("Bad hello from a worker (-workers %u?)\n",n_rank);
+			uint32_t r = msg[1];
+			if(r>=n_rank or link[r].fd>=0)
+				error("Bad or duplicate rank %u\n",r);
+			if(0==j)
+				n_word = msg[3];
+			else if(msg[3]!=n_word)
+				error("Worker %u has %u words, not %u\n",r,msg[3],n_word);
+			link[r].fd = l.fd;
+			l.fd = -1;
+			if(verbosity>0)
+				info("Worker %u of %u connected\n",r,n_rank);
+		}
+		::close(s);
+		if(0==strncmp(addr,"unix:",5))
+			unlink(addr+5);
+		m.word_stat.init(n_word,layout);
+		while(sync())
+			;
+		if(verbosity>0)
+			info("%u syncs, %u menus\n",n_sync,m.menu_stat.len);
+	}
+
+	// Update of a worker: #menu at its last sync, #new menus, changes
+	bool sync()
+	{
+		uint32_t n_menu = m.menu_stat.len;
+		Vec<uint32_t> msg;
+		Vec<uint32_t> base(n_rank);
+		Vec<Delta> ws, w;
+		Vec<MenuDelta> ms, mn;
+		for(uint32_t j=0;j<n_rank;j++)
+		{
+			if(!link[j].recv(msg))
+			{
+				if(j>0)
+					error("Worker %u left before the others\n",j);
+				for(j=1;j<n_rank;j++)
+					if(link[j].recv(msg))
+						error("Worker 0 left before the others\n");
+				return false;
+			}
+			MsgReader rd(msg);
+			if(rd.get()!=n_menu)
+				error("Worker %u is out of sync\n",j);
+			uint32_t n_new = rd.get();
+			base.push_back(m.menu_stat.len);
+			for(uint32_t k=0;k<n_new;k++)
+				m.add_menu();
+			w.clear();
+			mn.clear();
+			rd.get_deltas(w,n_menu+n_new);
+			rd.get_menu_deltas(mn,n_menu+n_new);
+			#define REMAP(k) ((k)<n_menu?(k):base[j]+(k)-n_menu)
+			for(uint32_t i=0;i<w.len;i++)
+			{
+				w[i].k = REMAP(w[i].k);
+				ws.push_back(w[i]);
+			}
+			for(uint32_t i=0;i<mn.len;i++)
+			{
+				mn[i].k = REMAP(mn[i].k);
+				ms.push_back(mn[i]);
+			}
+			#undef REMAP
+		}
+		sum_deltas(ws);
+		add_deltas(m,ws,ms);
+		uint32_t n_total = m.menu_stat.len;
+		Vec<uint32_t> src;
+		uint32_t len = m.menu_src(src);
+		if(len<n_total)
+			m.compact(src,len);
+		// Reply: first id of the new menus, #menu, changes, compaction
+		for(uint32_t j=0;j<n_rank;j++)
+		{
+			msg.clear();
+			msg.push_back(base[j]);
+			msg.push_back(n_total);
+			put_deltas(msg,ws);
+			put_menu_deltas(msg,ms);
+			msg.push_back(len);
+			for(uint32_t i=0;len<n_total and i<n_total;i++)
+				msg.push_back(src[i]);
+			link[j].send(msg);
+		}
+		n_sync++;
+		if(verbosity>1)
+			info("sync %u: %u changes, %u menus\n",n_sync,ws.len,m.menu_stat.len);
+		return true;
+	}
+};
+
+/**
+ * Worker side: the changes to h.word_stat since the last sync are kept
+ * by its journal, those to menu_stat by the copy at the sync.
+ */
+class DistWorker
+{
+public:
+	Link link;
+	Journal journal;
+	Vec<Delta> ws; // nonzero changes of journal at a sync
+	Vec<uint32_t> menu_base; // menu_stat at the last sync
+	uint32_t menu_sum_base;
+
+	DistWorker(): menu_sum_base(0) {}
+
+	// First doc of worker rank of n_rank for n_doc docs
+	static uint32_t shard(uint32_t n_doc, uint32_t rank, uint32_t n_rank)
+	{
+		return (uint64_t)n_doc*rank/n_rank;
+	}
+
+	void connect(const char* addr, uint32_t rank, uint32_t n_rank, uint32_t n_word)
+	{
+		link.connect_to(addr,60);
+		Vec<uint32_t> msg;
+		msg.push_back(ParamServer::HELLO);
+		msg.push_back(rank);
+		msg.push_back(n_rank);
+		msg.push_back(n_word);
+		link.send(msg);
+	}
+
+	// Changes of h are from now on (its model is the server's)
+	void start(HDP& h)
+	{
+		journal.clear();
+		h.word_stat.journal = &journal;
+		menu_base.copy_from(h.menu_stat);
+		menu_sum_base = h.menu_stat_sum;
+	}
+
+	void sync(HDP& h)
+	{
+		h.word_stat.journal = NULL;
+		uint32_t n_base = menu_base.len;
+		uint32_t n_menu = h.menu_stat.len;
+		journal.get(ws);
+		Vec<MenuDelta> ms;
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			MenuDelta dl = {k,(int32_t)(h.menu_stat[k]-(k<n_base?menu_base[k]:0))};
+			if(0!=dl.n)
+				ms.push_back(dl);
+		}
+		Vec<uint32_t> msg;
+		msg.push_back(n_base);
+		msg.push_back(n_menu-n_base);
+		put_deltas(msg,ws);
+		put_menu_deltas(msg,ms);
+		link.send(msg);
+		if(!link.recv(msg))
+			error("The server closed the link\n");
+		// Back to the model of the last sync
+		for(uint32_t i=0;i<ws.len;i++)
+		{
+			h.word_stat.add(ws[i].k,ws[i].w,-ws[i].n);
+			h.word_stat_sum[ws[i].k] -= ws[i].n;
+		}
+		Vec<uint32_t> keep;
+		for(uint32_t k=0;k<n_base;k++)
+			keep.push_back(k);
+		h.menu_stat.copy_from(menu_base);
+		h.menu_stat_sum = menu_sum_base;
+		h.word_stat_sum.len = n_base;
+		h.word_stat.compact(keep.head,n_base);
+		// New menus as numbered by the server, then all changes
+		MsgReader rd(msg);
+		uint32_t base = rd.get();
+		uint32_t n_total = rd.get();
+		if(base<n_base or base+n_menu-n_base>n_total)
+			error("Bad reply of the server\n");
+		for(uint32_t d=0;d<h.n_doc;d++)
+		{
+			Span<uint32_t> mn = h.menu[d];
+			for(uint32_t t=0;t<mn.len;t++)
+				if(mn[t]>=n_base)
+					mn[t] += base-n_base;
+		}
+		while(h.menu_stat.len<n_total)
+			h.add_menu();
+		ws.clear();
+		ms.clear();
+		rd.get_deltas(ws,n_total);
+		rd.get_menu_deltas(ms,n_total);
+		add_deltas(h,ws,ms);
+		uint32_t len = rd.get();
+		if(len<n_total)
+		{
+			Vec<uint32_t> src;
+			for(uint32_t j=0;j<n_total;j++)
+			{
+				uint32_t k = rd.get();
+				if(k>=n_total)
+					error("Bad reply of the server\n");
+				src.push_back(k);
+			}
+			h.compact_menus(src,len);
+		}
+		start(h);
+	}
+
+	// Tell the server this worker is done
+	void close(HDP& h)
+	{
+		h.word_stat.journal = NULL;
+		link.close();
+	}
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "vec.hpp"
+#include "arena.hpp"
+#include "corpus.hpp"
+#include "qlog.hpp"
+
+/**
+ * Seating of all docs, without a heap block per doc and array:
+ *  - per token: one flat array of records (see Tokens), doc d from
+ *    byte at[d], holding its word ids so that a sweep reads one stream
+ *  - per table (table_stat, menu, table_head): a block per doc from
+ *    the arena, with the three fields of cap entries each; a full block
+ *    moves to one twice as large and is reused for other docs
+ * Field j of the tables of doc d is seen as a Span through TableField.
+ */
+class DocState
+{
+public:
+	enum { INIT_CAP = 4 };
+
+	struct Tables
+	{
+		uint32_t* x;
+		uint32_t len;
+		uint32_t cap;
+	};
+
+	// Record of a token: its word, its table and the next word at that
+	// table. Indices are 16-bit in docs of less than WIDE/2 words, 0xffff
+	// standing for NIL: emptied tables stay until remove_empty(), so a
+	// doc has up to twice as many tables as words within a sweep.
+	enum { WIDE = 0xffff, NIL = 0xffffffffu };
+
+	static bool is_wide(uint32_t n) { return 2*(uint64_t)n+1>=WIDE; }
+
+	template<class I>
+	struct Tok
+	{
+		uint32_t word;
+		I table;
+		I next;
+	};
+	typedef Tok<uint16_t> Tok16;
+	typedef Tok<uint32_t> Tok32;
+
+	// The len records of a doc, then the previous word at the table of
+	// each (read only when unlinking a word)
+	struct Tokens
+	{
+		uint8_t* x;
+		uint32_t len;
+		bool wide;
+
+		Tok16* t16() const { return (Tok16*)x; }
+		Tok32* t32() const { return (Tok32*)x; }
+		uint16_t* p16() const { return (uint16_t*)(x+len*sizeof(Tok16)); }
+		uint32_t* p32() const { return (uint32_t*)(x+len*sizeof(Tok32)); }
+
+		static uint32_t nil(uint16_t v) { return v==0xffffu?NIL:v; }
+
+		uint32_t word(uint32_t i) const
+		{
+			qassert(i<len);
+			return wide?t32()[i].word:t16()[i].word;
+		}
+
+		uint32_t table(uint32_t i) const
+		{
+			qassert(i<len);
+			return wide?t32()[i].table:t16()[i].table;
+		}
+
+		uint32_t next(uint32_t i) const
+		{
+			qassert(i<len);
+			return wide?t32()[i].next:nil(t16()[i].next);
+		}
+
+		uint32_t prev(uint32_t i) const
+		{
+			qassert(i<len);
+			return wide?p32()[i]:nil(p16()[i]);
+		}
+
+		void set_table(uint32_t i, uint32_t t)
+		{
+			qassert(i<len and (wide or t<0xffffu));
+			if(wide) t32()[i].table = t; else t16()[i].table = t;
+		}
+
+		// NIL is cut to 0xffff in 16 bits
+		void set_next(uint32_t i, uint32_t j)
+		{
+			qassert(i<len);
+			if(wide) t32()[i].next = j; else t16()[i].next = j;
+		}
+
+		void set_prev(uint32_t i, uint32_t j)
+		{
+			qassert(i<len);
+			if(wide) p32()[i] = j; else p16()[i] = j;
+		}
+	};
+
+	// Field j of the tables of doc d
+	struct TableField
+	{
+		DocState* s;
+		uint32_t j;
+
+		Span<uint32_t> operator[](uint32_t d) const
+		{
+			Tables& t = s->tab[d];
+			Span<uint32_t> x = {t.x+j*t.cap,t.len};
+			return x;
+		}
+	};
+
+	uint32_t n_doc;
+	uint64_t n_token;
+	const uint64_t* offset; // of the corpus
+	uint64_t* at; // byte of the tokens of doc d in tok
+	uint8_t* tok;
+	Tables* tab;
+	Arena arena;
+
+	DocState(): n_doc(0), n_token(0), offset(NULL), at(NULL), tok(NULL), tab(NULL) {}
+
+	~DocState() { dtor(); }
+
+	void dtor()
+	{
+		free(at);
+		free(tok);
+		free(tab);
+		at = NULL;
+		tok = NULL;
+		tab = NULL;
+		arena.dtor();
+		n_doc = 0;
+		n_token = 0;
+	}
+
+	// Bytes of the tokens of a doc of n words, a multiple of 4
+	static uint64_t tok_size(uint32_t n)
+	{
+		if(is_wide(n))
+			return n*(uint64_t)(sizeof(Tok32)+sizeof(uint32_t));
+		return (n*(uint64_t)(sizeof(Tok16)+sizeof(uint16_t))+3)/4*4;
+	}
+
+	// No doc has tables, tokens are unseated
+	void init(const Corpus& c)
+	{
+		dtor();
+		n_doc = c.n_doc;
+		n_token = c.n_token;
+		offset = c.offset;
+		qassert((at=(uint64_t*)malloc((n_doc+1)*sizeof(uint64_t))));
+		at[0] = 0;
+		for(uint32_t d=0;d<n_doc;d++)
+			at[d+1] = at[d]+tok_size(offset[d+1]-offset[d]);
+		if(at[n_doc]>0)
+			qassert((tok=(uint8_t*)malloc(at[n_doc])));
+		for(uint32_t d=0;d<n_doc;d++)
+		{
+			Tokens x = tokens(d);
+			const uint32_t* w = c.token+offset[d];
+			for(uint32_t i=0;i<x.len;i++)
+			{
+				if(x.wide)
+				{
+					Tok32 r = {w[i],0,NIL};
+					x.t32()[i] = r;
+				}
+				else
+				{
+					Tok16 r = {w[i],0,0xffff};
+					x.t16()[i] = r;
+				}
+				x.set_prev(i,NIL);
+			}
+		}
+		qassert((tab=(Tables*)malloc((n_doc>0?n_doc:1)*sizeof(Tables))));
+		memset(tab,0,n_doc*sizeof(Tables));
+	}
+
+	Tokens tokens(uint32_t d) const
+	{
+		uint32_t n = offset[d+1]-offset[d];
+		Tokens x = {tok+at[d],n,is_wide(n)};
+		return x;
+	}
+
+	// Add a table at the end of doc d, return its index
+	uint32_t push_table(uint32_t d)
+	{
+		Tables& t = tab[d];
+		if(t.len==t.cap)
+			reserve(d,t.cap>0?2*t.cap:INIT_CAP);
+		qassert(t.len<0xffffu or tokens(d).wide);
+		return t.len++;
+	}
+
+	// Room for n tables in doc d
+	void reserve(uint32_t d, uint32_t n)
+	{
+		Tables& t = tab[d];
+		if(n<=t.cap)
+			return;
+		uint32_t* x = arena.alloc(3*(uint64_t)n);
+		for(uint32_t j=0;j<3 and t.len>0;j++)
+			memcpy(x+j*n,t.x+j*t.cap,t.len*sizeof(uint32_t));
+		arena.release(t.x,3*(uint64_t)t.cap);
+		t.x = x;
+		t.cap = n;
+	}
+
+	// Bytes used, without the corpus
+	uint64_t memory()
+	{
+		return (n_doc>0?at[n_doc]:0)+(n_doc+1)*sizeof(uint64_t)+n_doc*sizeof(Tables)+arena.memory();
+	}
+};
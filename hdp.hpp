@@ -4,8 +4,16 @@
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <pthread.h>
 #include "vec.hpp"
 #include "pct.hpp"
+#include "rng.hpp"
+#include "simd.hpp"
+#include "wordstat.hpp"
+#include "alias.hpp"
+#include "corpus.hpp"
+#include "docstate.hpp"
+#include "snapshot.hpp"
 
 #include "qlog.hpp"
 
@@ -22,10 +30,280 @@ void prop_exp(T* x, uint32_t len)
 		x[i] = exp(x[i]-mean);
 }
 
+inline void prop_exp(double* x, uint32_t len)
+{
+	SimdKernels& s = simd();
+	s.exp_shift(x,len,s.finite_mean(x,len));
+}
+
+/**
+ * Statistics shared by all documents (the franchise)
+ */
+class Model
+{
+public:
+	Vec<uint32_t> menu_stat;
+	uint32_t menu_stat_sum;
+
+	WordStat word_stat;
+	Vec<uint32_t> word_stat_sum;
+
+	Model(): menu_stat_sum(0) {}
+
+	void dtor()
+	{
+		word_stat.dtor();
+	}
+
+	// Append an empty menu, return its index
+	uint32_t add_menu()
+	{
+		word_stat.add_topic();
+		word_stat_sum.push_back(0);
+		menu_stat.push_back(0);
+		return menu_stat.len-1;
+	}
+
+	// Deep copy, reusing rows already allocated
+	void copy_from(Model& m)
+	{
+		word_stat.copy_from(m.word_stat);
+		word_stat_sum.copy_from(m.word_stat_sum);
+		menu_stat.copy_from(m.menu_stat);
+		menu_stat_sum = m.menu_stat_sum;
+	}
+
+	/**
+	 * Empty menus removed as if the last menu moved to each of them
+	 * (from high to low k), but done on the ids so that each table is
+	 * relabelled once: menu src[j] becomes menu j, j<len returned.
+	 */
+	uint32_t menu_src(Vec<uint32_t>& src)
+	{
+		uint32_t n_menu = menu_stat.len;
+		src.resize(n_menu);
+		for(uint32_t k=0;k<n_menu;k++)
+			src[k] = k;
+		uint32_t len = n_menu;
+		for(int k=n_menu-1;k>=0;k--)
+			if(0==menu_stat[k])
+				src[k] = src[--len];
+		return len;
+	}
+
+	// Keep menus src[0],...,src[len-1] (see menu_src())
+	void compact(const Vec<uint32_t>& src, uint32_t len)
+	{
+		for(uint32_t j=0;j<len;j++) // src[j]>=j
+		{
+			menu_stat[j] = menu_stat[src[j]];
+			word_stat_sum[j] = word_stat_sum[src[j]];
+		}
+		menu_stat.len = len;
+		word_stat_sum.len = len;
+		word_stat.compact(src.head,len);
+	}
+
+	// Log-likelihood of the words given the menus (Dirichlet-multinomial
+	// per menu, prior beta)
+	double word_loglik(double beta)
+	{
+		double s = 0;
+		uint32_t n_word = word_stat.n_word;
+		Vec<uint32_t> w, n;
+		for(uint32_t k=0;k<menu_stat.len;k++)
+		{
+			w.clear();
+			n.clear();
+			word_stat.row_pairs(k,w,n);
+			for(uint32_t i=0;i<n.len;i++)
+				s += lgamma(n[i]+beta);
+			s -= n.len*lgamma(beta);
+			s += lgamma(n_word*beta)-lgamma(word_stat_sum[k]+n_word*beta);
+		}
+		return s;
+	}
+
+	void summary(uint32_t verbosity)
+	{
+		if(verbosity>0)
+			printf("#menu: %5u	#table: %8u\n",menu_stat.len,menu_stat_sum);
+		if(verbosity>1)
+		{
+			for(uint32_t k=0;k<menu_stat.len;k++)
+			{
+				printf("menu %3u: ",k);
+				printf("#table: %5u  ",menu_stat[k]);
+				printf("#word: %7u\n",word_stat_sum[k]);
+			}
+			printf("word_stat: %.1f MB\n",word_stat.memory()/1048576.0);
+		}
+	}
+
+	void save(SnapWriter& sw)
+	{
+		sw.put(menu_stat_sum);
+		sw.put_vec(menu_stat);
+		sw.put_vec(word_stat_sum);
+		word_stat.save(sw);
+	}
+
+	void load(SnapReader& sr)
+	{
+		menu_stat_sum = sr.get<uint32_t>();
+		sr.get_vec(menu_stat);
+		sr.get_vec(word_stat_sum);
+		word_stat.load(sr);
+		if(word_stat.len!=menu_stat.len or word_stat_sum.len!=menu_stat.len)
+			error("%s: bad number of menus\n",sr.filename);
+	}
+};
+
+/**
+ * Start of a snapshot written by HDP::save()
+ */
+struct SnapHead
+{
+	enum { MAGIC = 0x4b504448u, VERSION = 2 }; // "HDPK"
+
+	uint32_t n_doc;
+	uint32_t n_word;
+	uint64_t n_token;
+	uint32_t iter;
+	double alpha;
+	double beta;
+	double gamma;
+	uint64_t rng;
+	uint64_t seed;
+	uint64_t sweep;
+
+	void save(SnapWriter& sw)
+	{
+		sw.put((uint32_t)MAGIC);
+		sw.put((uint32_t)VERSION);
+		sw.put(n_doc);
+		sw.put(n_word);
+		sw.put(n_token);
+		sw.put(iter);
+		sw.put(alpha);
+		sw.put(beta);
+		sw.put(gamma);
+		sw.put(rng);
+		sw.put(seed);
+		sw.put(sweep);
+	}
+
+	void load(SnapReader& sr)
+	{
+		if(MAGIC!=sr.get<uint32_t>())
+			error("%s is not a snapshot\n",sr.filename);
+		if(VERSION!=sr.get<uint32_t>())
+			error("%s: unsupported snapshot version\n",sr.filename);
+		n_doc = sr.get<uint32_t>();
+		n_word = sr.get<uint32_t>();
+		n_token = sr.get<uint64_t>();
+		iter = sr.get<uint32_t>();
+		alpha = sr.get<double>();
+		beta = sr.get<double>();
+		gamma = sr.get<double>();
+		rng = sr.get<uint64_t>();
+		seed = sr.get<uint64_t>();
+		sweep = sr.get<uint64_t>();
+	}
+};
+
+class HDP;
+
+/**
+ * Word proposal of the alias sampler: menus with nonzero count of the
+ * word (sorted) and their weights when the table was built.
+ */
+struct WordAlias
+{
+	Vec<uint32_t> menu;
+	Vec<double> weight;
+	AliasTable tab;
+	double mass;
+	uint32_t use; // draws since built
+	uint32_t epoch;
+
+	WordAlias(): mass(0), use(0), epoch(0) {}
+
+	// Weight of menu k at build time (0 if absent)
+	double get(uint32_t k)
+	{
+		uint32_t lo = 0, hi = menu.len;
+		while(lo<hi)
+		{
+			uint32_t mid = (lo+hi)/2;
+			if(menu[mid]<k)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		return (lo<menu.len and menu[lo]==k)?weight[lo]:0;
+	}
+};
+
+/**
+ * Sampling context of one thread
+ */
+struct Worker
+{
+	HDP* hdp;
+	Model* m; // the model sampled against
+	Rng rng; // stream of the current doc, see HDP::doc_rng()
+
+	Model replica; // private copy of the model in parallel sweep
+	Vec<Delta> log; // changes to replica.word_stat
+	bool logging;
+	const uint32_t* order; // shuffled list of docs
+	uint32_t begin, end; // range of docs in order
+
+	Vec<double> p; // prob without normalization
+	Vec<double> q; // cum prob to be filled by rmult()
+	Vec<uint32_t> local_stat;
+
+	// Bucket sampler, see HDP::bucket_prepare()
+	Vec<uint32_t>* nz; // menus with nonzero count of word w
+	Vec<double> inv; // 1/(word_stat_sum[k]+beta*n_word)
+	double s_sum; // sum_k menu_stat[k]*inv[k]
+	Vec<uint32_t> doc_cnt; // #words of current doc served with menu k
+	Vec<uint32_t> doc_menu; // menus with doc_cnt[k]>0
+	double r_sum; // beta*sum_k doc_cnt[k]*inv[k]
+	Vec<uint32_t> words;
+
+	// Split-merge, see HDP::split_merge()
+	Vec<uint64_t> sm_order; // tables (d<<32|t) in allocation order
+	Vec<uint8_t> sm_side; // of table i of sm_order, 0: first menu
+
+	// Alias sampler, see HDP::alias_doc()
+	WordAlias* word_alias; // word proposal of word w, built lazily
+	uint32_t epoch; // word proposals of an older epoch are stale
+	AliasTable smooth_alias; // ~ beta*inv[k], shared by all words
+	Vec<double> smooth_weight;
+	double smooth_mass;
+	uint32_t smooth_use;
+	AliasTable menu_alias; // ~ menu_stat[k], last entry a new menu
+	Vec<double> menu_weight;
+	double menu_mass;
+	uint32_t menu_use;
+
+	Worker(): hdp(NULL), m(NULL), logging(false), order(NULL), begin(0), end(0), nz(NULL), s_sum(0), r_sum(0),
+		word_alias(NULL), epoch(0), smooth_mass(0), smooth_use(~0u),
+		menu_mass(0), menu_use(~0u) {}
+
+	~Worker()
+	{
+		delete[] nz;
+		delete[] word_alias;
+	}
+};
+
 /**
  * HDP in CRF representation
  */
-class HDP
+class HDP : public Model
 {
 public:
 	const uint32_t n_doc;
@@ -35,242 +313,1279 @@ public:
 	double beta;
 	double gamma;
 
-	Vec<uint32_t>* dat;
-
-	Vec<uint32_t>* table_stat;
-	Vec<uint32_t> menu_stat;
-	uint32_t menu_stat_sum;
+	Corpus dat;
 
-	Vec<uint32_t*> word_stat;
-	Vec<uint32_t> word_stat_sum;
+	DocState st; // storage of the fields below, x[d] is a Span
+	DocState::TableField table_stat;
+	DocState::TableField menu;
 
-	Vec<uint32_t>* table;
-	Vec<uint32_t>* menu;
+	// Words at each table as doubly linked lists, through the token
+	// records st.tokens(d) (word, table, next and previous word)
+	DocState::TableField table_head; // first word at table t, NIL if none
+	enum { NIL = DocState::NIL };
 
 	PCT pct_log;
 	PCT pct_log_b;
 	PCT pct_log_nb;
 	PCT pct_log_g;
 
+	enum Sampler { SAMPLER_PLAIN, SAMPLER_BUCKET, SAMPLER_ALIAS };
+	Sampler sampler;
+	uint32_t mh_steps; // for SAMPLER_ALIAS
+
+	uint32_t n_thread;
+	Worker* worker;
+
+	// Commit of gibbs_menu() with threads, see gibbs_menu_batch()
+	enum MenuCommit { MENU_EXACT, MENU_DELAYED };
+	MenuCommit menu_commit;
+	enum { MENU_BATCH = 64 }; // tables per thread in a batch
+	struct MenuBatch
+	{
+		uint32_t len; // tables wanted in a batch
+		Vec<uint32_t> row; // first table of doc i of the batch
+		uint32_t n_menu; // at the start of the batch
+		Vec<double> score; // n_menu+1 per table
+		Vec<uint32_t> res; // menu drawn with MENU_DELAYED
+		Vec<uint32_t> dirty; // menu k changed by the commit so far
+		Vec<uint32_t> dirty_menu;
+		pthread_barrier_t barrier; // of the workers, see gibbs_menu_batch()
+		bool stop;
+	};
+	MenuBatch batch;
+	Vec<uint32_t> table_order; // shuffled doc list of gibbs_table()
+	Vec<uint32_t> menu_order; // shuffled doc list of gibbs_menu()
+
+	// Candidate move of split_merge() between the menus of two tables
+	struct SplitPair
+	{
+		uint64_t a[2]; // anchor tables, d<<32|t
+		uint32_t k[2]; // their menus when the move runs
+		uint32_t k_new; // empty menu for a split
+		bool accept;
+	};
+	Vec<SplitPair> sm_pair;
+	Vec<uint32_t> sm_wave; // pairs of the current wave
+	Vec<uint32_t> sm_start; // tables of menu k: sm_table[sm_start[k]...]
+	Vec<uint64_t> sm_table;
+
+	// Random numbers of doc d in a sweep come from stream
+	// (d,n_sweep,kind) of seed, whatever the thread.
+	enum RngKind { RNG_INIT, RNG_TABLE, RNG_MENU, RNG_SPLIT };
+	uint64_t seed;
+	uint64_t n_sweep; // calls of gibbs_table()
+	uint32_t doc_base; // id of doc 0 in the streams (shard of dist.hpp)
+
 	HDP(uint32_t _n_doc, uint32_t _n_word):
 		n_doc(_n_doc), n_word(_n_word)
 	{
-		dat = (Vec<uint32_t>*)malloc(n_doc*sizeof(Vec<uint32_t>));
-		memset(dat,0,n_doc*sizeof(Vec<uint32_t>));
-		table_stat = (Vec<uint32_t>*)malloc(n_doc*sizeof(Vec<uint32_t>));
-		memset(table_stat,0,n_doc*sizeof(Vec<uint32_t>));
-		table = (Vec<uint32_t>*)malloc(n_doc*sizeof(Vec<uint32_t>));
-		memset(table,0,n_doc*sizeof(Vec<uint32_t>));
-		menu = (Vec<uint32_t>*)malloc(n_doc*sizeof(Vec<uint32_t>));
-		memset(menu,0,n_doc*sizeof(Vec<uint32_t>));
+		dat.init(n_doc,n_word);
+		DocState::TableField f[3] = {{&st,0},{&st,1},{&st,2}};
+		table_stat = f[0];
+		menu = f[1];
+		table_head = f[2];
 		menu_stat_sum = 0;
+		word_stat.init(n_word,WordStat::DENSE);
+		for(uint32_t d=0;d<n_doc;d++)
+		{
+			table_order.push_back(d);
+			menu_order.push_back(d);
+		}
+		sampler = SAMPLER_PLAIN;
+		mh_steps = 4;
+		menu_commit = MENU_EXACT;
+		batch.len = 0;
+		seed = 0;
+		n_sweep = 0;
+		doc_base = 0;
+		n_thread = 0;
+		worker = NULL;
+		set_threads(1);
 	}
 
 	~HDP() { dtor(); }
 
 	void dtor()
 	{
+		st.dtor();
+		dat.dtor();
+		Model::dtor();
+		delete[] worker;
+		worker = NULL;
+	}
+
+	// Worker 0 samples against the model itself, the others only exist
+	// for parallel sweeps.
+	void set_threads(uint32_t n)
+	{
+		qassert(n>0);
+		delete[] worker;
+		n_thread = n;
+		worker = new Worker[n_thread];
+		for(uint32_t j=0;j<n_thread;j++)
+			worker[j].hdp = this;
+		worker[0].m = this;
+	}
+
+	// Storage of topic-word counts, to be set before init()
+	void set_layout(WordStat::Layout layout)
+	{
+		qassert(word_stat.len==0);
+		word_stat.init(n_word,layout);
+	}
+
+	// The tables cover counts up to buffer_size, by default all the
+	// counts possible with the data (at most n_token)
+	void config(double a, double b, double g, uint32_t buffer_size=0)
+	{
+		alpha = a;
+		beta = b;
+		gamma = g;
+
+		if(0==buffer_size)
+		{
+			uint64_t n = (dat.n_token>n_word?dat.n_token:n_word)+1;
+			buffer_size = n<(1u<<31)?n:(1u<<31);
+		}
+		pct_log.make(buffer_size,log,0);
+		pct_log_b.make(buffer_size,log,beta);
+		pct_log_nb.make(buffer_size,log,beta*n_word);
+		pct_log_g.make(buffer_size,log,gamma);
+	}
+
+	void add_entry(uint32_t doc, uint32_t word)
+	{
+		dat.add_entry(doc,word);
+	}
+
+	void read_data(const char* filename) // in lda-c or binary format
+	{
+		dat.load(filename,n_doc,n_word,n_thread);
+		st.init(dat);
+	}
+
+	// Use the docs of c (which is left empty)
+	void set_data(Corpus& c)
+	{
+		qassert(c.n_doc==n_doc and c.n_word==n_word);
+		dat.swap(c);
+		c.dtor();
+		st.init(dat);
+	}
+
+	// Storage for the seating of the docs read so far
+	void state_init()
+	{
+		if(st.offset!=dat.offset or st.n_token!=dat.n_token)
+			st.init(dat);
+	}
+
+	void init0()
+	{
+		// 1 table for a doc, 1 menu for the franchise.
+		state_init();
+		add_menu();
 		for(uint32_t d=0;d<n_doc;d++)
-			dat[d].dtor();
-		free(dat);
-		for(uint32_t d=0;d<n_doc;d++)
-			table_stat[d].dtor();
-		free(table_stat);
-		for(uint32_t k=0;k<word_stat.len;k++)
-			free(word_stat[k]);
-		word_stat.clear();
-		for(uint32_t d=0;d<n_doc;d++)
-			table[d].dtor();
-		free(table);	
-		for(uint32_t d=0;d<n_doc;d++)
-			menu[d].dtor();
-		free(menu);
+		{
+			add_table(d,0); //menu[d][table[d][i]];
+			menu_stat[0]++;
+			menu_stat_sum++;
+			for(uint32_t i=0;i<dat[d].len;i++)
+			{
+				link_word(d,i,0);
+				word_stat.inc(0,dat[d][i]); //dat[d][i].n;
+				word_stat_sum[0]++; //dat[d][i].n;
+				table_stat[d][0]++; //dat[d][i].n;
+			}
+		}
+	}
+
+	// Put word i of doc d in the list of table t (and its table to t)
+	void link_word(uint32_t d, uint32_t i, uint32_t t)
+	{
+		DocState::Tokens x = st.tokens(d);
+		Span<uint32_t> head = table_head[d];
+		uint32_t h = head[t];
+		x.set_table(i,t);
+		x.set_prev(i,NIL);
+		x.set_next(i,h);
+		if(h!=NIL)
+			x.set_prev(h,i);
+		head[t] = i;
+	}
+
+	// Take word i of doc d out of the list of its table
+	void unlink_word(uint32_t d, uint32_t i)
+	{
+		DocState::Tokens x = st.tokens(d);
+		uint32_t p = x.prev(i);
+		uint32_t n = x.next(i);
+		if(p!=NIL)
+			x.set_next(p,n);
+		else
+			table_head[d][x.table(i)] = n;
+		if(n!=NIL)
+			x.set_prev(n,p);
+	}
+
+	// Open a new table in doc d serving menu k
+	void add_table(uint32_t d, uint32_t k)
+	{
+		uint32_t t = st.push_table(d);
+		table_stat[d][t] = 0;
+		menu[d][t] = k;
+		table_head[d][t] = NIL;
+	}
+
+	// Words at table t of doc d to wk.words
+	void table_words(Worker& wk, uint32_t d, uint32_t t)
+	{
+		DocState::Tokens x = st.tokens(d);
+		wk.words.clear();
+		for(uint32_t i=table_head[d][t];i!=NIL;i=x.next(i))
+			wk.words.push_back(x.word(i));
+	}
+
+	void doc_rng(Worker& wk, uint32_t d, RngKind kind)
+	{
+		wk.rng.set(seed,doc_base+d,(uint32_t)n_sweep,kind);
+	}
+
+	// Seat the words of docs first,...,n_doc-1 (the others are seated)
+	void init(uint32_t first=0)
+	{
+		if(first>=n_doc)
+			return;
+		state_init();
+		Vec<uint32_t> x(n_doc-first);
+		for(uint32_t d=first;d<n_doc;d++)
+			x.push_back(d);
+		shuffle(&(x[0]),x.len);
+		for(uint32_t di=0;di<x.len;di++)
+		{
+			doc_rng(worker[0],x[di],RNG_INIT);
+			for(uint32_t i=0;i<dat[x[di]].len;i++)
+			{
+				uint32_t d = x[di];
+				// assign_user(d,i)
+				reassign_user(worker[0],d,i,true);
+			}
+		}
+	}
+
+	// Shuffled docs first,...,n_doc-1: all (table_order or menu_order)
+	// if first is 0, otherwise a new list in part
+	const uint32_t* doc_order(Vec<uint32_t>& all, Vec<uint32_t>& part, uint32_t first)
+	{
+		if(0==first)
+		{
+			shuffle(&(all[0]),n_doc);
+			return all.head;
+		}
+		part.clear();
+		for(uint32_t d=first;d<n_doc;d++)
+			part.push_back(d);
+		if(part.len>0)
+			shuffle(&(part[0]),part.len);
+		return part.head;
+	}
+
+	// Resample tables of docs first,...,n_doc-1
+	void gibbs_table(uint32_t first=0)
+	{
+		Vec<uint32_t> part;
+		const uint32_t* x = doc_order(table_order,part,first);
+		uint32_t n = n_doc-first;
+		n_sweep++;
+		if(n_thread==1)
+		{
+			if(sampler!=SAMPLER_PLAIN)
+				bucket_prepare(worker[0]);
+			for(uint32_t d=0;d<n;d++)
+				sample_doc(worker[0],x[d]);
+			return;
+		}
+		// Approximate distributed sampling (AD-LDA):
+		// each thread samples its share of docs against a private copy
+		// of the model, the changes are merged after all threads finish.
+		uint64_t n_token = 0;
+		for(uint32_t d=0;d<n;d++)
+			n_token += dat[x[d]].len;
+		uint64_t acc = 0;
+		uint32_t d = 0;
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			Worker& wk = worker[j];
+			wk.m = &wk.replica;
+			wk.logging = true;
+			wk.order = x;
+			wk.begin = d;
+			while(d<n and acc*n_thread<n_token*(j+1))
+				acc += dat[x[d++]].len;
+			wk.end = (j==n_thread-1)?n:d;
+		}
+		pthread_t* th = (pthread_t*)malloc(n_thread*sizeof(pthread_t));
+		for(uint32_t j=0;j<n_thread;j++)
+			if(pthread_create(&th[j],NULL,gibbs_table_thread,&worker[j]))
+				error("Cannot create thread %u.\n",j);
+		for(uint32_t j=0;j<n_thread;j++)
+			pthread_join(th[j],NULL);
+		free(th);
+		merge_workers();
+		worker[0].m = this;
+		worker[0].logging = false;
+	}
+
+	static void* gibbs_table_thread(void* arg)
+	{
+		Worker& wk = *(Worker*)arg;
+		HDP& h = *wk.hdp;
+		wk.replica.copy_from(h);
+		wk.log.clear();
+		if(h.sampler!=SAMPLER_PLAIN)
+			h.bucket_prepare(wk);
+		for(uint32_t d=wk.begin;d<wk.end;d++)
+			h.sample_doc(wk,wk.order[d]);
+		return NULL;
+	}
+
+	// Resample the tables of all words in doc d
+	void sample_doc(Worker& wk, uint32_t d)
+	{
+		doc_rng(wk,d,RNG_TABLE);
+		if(sampler==SAMPLER_BUCKET)
+		{
+			bucket_doc(wk,d);
+			return;
+		}
+		if(sampler==SAMPLER_ALIAS)
+		{
+			alias_doc(wk,d);
+			return;
+		}
+		for(uint32_t i=0;i<dat[d].len;i++)
+			reassign_user(wk,d,i);
+	}
+
+	// Add changes made by workers to the model, new menus of
+	// worker j are appended in order of j.
+	void merge_workers()
+	{
+		uint32_t n_menu = menu_stat.len;
+		Vec<uint32_t> old_menu_stat;
+		Vec<uint32_t> old_word_stat_sum;
+		old_menu_stat.copy_from(menu_stat);
+		old_word_stat_sum.copy_from(word_stat_sum);
+		uint32_t old_menu_stat_sum = menu_stat_sum;
+		for(uint32_t j=0;j<n_thread;j++)
+		{
+			Model& r = worker[j].replica;
+			uint32_t base = menu_stat.len;
+			for(uint32_t k=n_menu;k<r.menu_stat.len;k++)
+				add_menu();
+			#define REMAP(k) ((k)<n_menu?(k):base+(k)-n_menu)
+			for(uint32_t k=0;k<r.menu_stat.len;k++)
+			{
+				menu_stat[REMAP(k)] += r.menu_stat[k] - (k<n_menu?old_menu_stat[k]:0);
+				word_stat_sum[REMAP(k)] += r.word_stat_sum[k] - (k<n_menu?old_word_stat_sum[k]:0);
+			}
+			menu_stat_sum += r.menu_stat_sum - old_menu_stat_sum;
+			Vec<Delta>& log = worker[j].log;
+			for(uint32_t i=0;i<log.len;i++)
+				word_stat.add(REMAP(log[i].k),log[i].w,log[i].n);
+			if(base!=n_menu)
+				for(uint32_t d=worker[j].begin;d<worker[j].end;d++)
+				{
+					Span<uint32_t> mn = menu[worker[j].order[d]];
+					for(uint32_t t=0;t<mn.len;t++)
+						mn[t] = REMAP(mn[t]);
+				}
+			#undef REMAP
+		}
+	}
+
+	void reassign_user(uint32_t d, uint32_t i, bool firstrun=false)
+	{
+		reassign_user(worker[0],d,i,firstrun);
+	}
+
+	void reassign_user(Worker& wk, uint32_t d, uint32_t i, bool firstrun=false)
+	{
+		Model& m = *wk.m;
+		Vec<double>& p = wk.p; // prob without normalization
+		Vec<double>& q = wk.q; // cum prob to be filled by rmult()
+		double lprob_t, lprob_k;
+		DocState::Tokens x = st.tokens(d);
+		uint32_t w = x.word(i);
+		uint32_t k_old = ~0u;
+		// Remove statistics
+		if(not firstrun) {
+			uint32_t t = x.table(i);
+			uint32_t k = menu[d][t];
+			m.word_stat.dec(k,w); //dat[d][i].n;
+			m.word_stat_sum[k]--; //dat[d][i].n;
+			table_stat[d][t]--; //dat[d][i].n;
+			unlink_word(d,i);
+			k_old = k;
+		}
+		// 1. Take an existing table.
+		for(uint32_t t=0;t<table_stat[d].len;t++)
+		{
+			lprob_t = pct_log(table_stat[d][t]);
+			p.push_back(lprob_t);
+			q.push_back(0);
+			// g_k = P(w_di | t_di)
+			uint32_t k = menu[d][t];
+			p[t] += pct_log_b(m.word_stat.get(k,w)) - pct_log_nb(m.word_stat_sum[k]);
+		}
+		// 2. Take a new table with an existing menu.
+		lprob_t = log(alpha);
+		uint32_t* col = m.word_stat.column(w); // sequential scan if word-major
+		for(uint32_t k=0;k<m.menu_stat.len;k++)
+		{
+			lprob_k = pct_log(m.menu_stat[k]) - pct_log_g(m.menu_stat_sum);
+			p.push_back(lprob_t+lprob_k);
+			q.push_back(0);
+			uint32_t n_kw = (NULL!=col)?col[k]:m.word_stat.get(k,w);
+			p[p.len-1] += pct_log_b(n_kw) - pct_log_nb(m.word_stat_sum[k]);
+		}
+		// 3. Take a new table with a new menu.
+		lprob_k = pct_log_g(0) - pct_log_g(m.menu_stat_sum);
+		p.push_back(lprob_t + lprob_k);
+		q.push_back(0);
+		p[p.len-1] += -pct_log(n_word);
+		// Exponetial
+		prop_exp(&p[0],p.len);
+		// Draw random number
+		uint32_t res = rmultinorm_r(&wk.rng,&p[0],&q[0],p.len);
+		p.clear();
+		q.clear();
+		uint32_t res_t = res<table_stat[d].len?res:table_stat[d].len;
+		if(res_t==table_stat[d].len) // New table in d
+		{
+			uint32_t res_k = res - table_stat[d].len;
+			add_table(d,res_k);
+			if(res_k==m.menu_stat.len) // New menu!
+				m.add_menu();
+			// Update for New table
+			m.menu_stat[res_k]++;
+			m.menu_stat_sum++;
+		}
+		link_word(d,i,res_t);
+		// Update statistics
+		if(true) {
+			uint32_t t = x.table(i);
+			uint32_t k = menu[d][t];
+			m.word_stat.inc(k,w);//dat[d][i].n;
+			m.word_stat_sum[k]++;//dat[d][i].n;
+			table_stat[d][t]++;//dat[d][i].n;
+			if(wk.logging and k!=k_old)
+			{
+				if(k_old!=~0u)
+				{
+					Delta dl = {k_old,w,-1};
+					wk.log.push_back(dl);
+				}
+				Delta dl = {k,w,1};
+				wk.log.push_back(dl);
+			}
+		}
+	}
+
+	/**
+	 * Bucket sampler (as SparseLDA) for the same conditional as
+	 * reassign_user(). Summing over the tables serving menu k, word w
+	 * in doc d takes menu k with mass
+	 *   (c_dk + a*m_k) * (n_kw + beta) / (n_k + V*beta),  a = alpha/(M+gamma)
+	 * and a new menu with mass a*gamma/V. This splits into
+	 *   s = a*beta*sum_k m_k/(n_k+V*beta)          (smoothing only)
+	 *   r = beta*sum_k c_dk/(n_k+V*beta)            (menus of doc d)
+	 *   q = sum_{k:n_kw>0} n_kw*(c_dk+a*m_k)/(n_k+V*beta)
+	 * where only q has to be summed for each word, over the nonzeros
+	 * of w. Given the menu, the table is an existing one serving k
+	 * with prob ~ n_dt, or a new one with prob ~ a*m_k.
+	 *
+	 * The caches are built from the model at the start of a sweep
+	 * and updated by bucket_update() as counts change.
+	 */
+	void bucket_prepare(Worker& wk)
+	{
+		Model& m = *wk.m;
+		uint32_t n_menu = m.menu_stat.len;
+		if(NULL==wk.nz)
+			wk.nz = new Vec<uint32_t>[n_word];
+		for(uint32_t w=0;w<n_word;w++)
+			wk.nz[w].clear();
+		Vec<uint32_t>& words = wk.words;
+		if(m.word_stat.layout==WordStat::WORD)
+			for(uint32_t w=0;w<n_word;w++)
+			{
+				uint32_t* col = m.word_stat.column(w);
+				for(uint32_t k=0;k<n_menu;k++)
+					if(col[k]>0)
+						wk.nz[w].push_back(k);
+			}
+		else
+			for(uint32_t k=0;k<n_menu;k++)
+			{
+				words.clear();
+				m.word_stat.row_nz(k,words);
+				for(uint32_t i=0;i<words.len;i++)
+					wk.nz[words[i]].push_back(k);
+			}
+		wk.inv.resize(n_menu);
+		wk.s_sum = 0;
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			wk.inv[k] = 1.0/(m.word_stat_sum[k]+beta*n_word);
+			wk.s_sum += m.menu_stat[k]*wk.inv[k];
+		}
+		wk.doc_cnt.resize(n_menu);
+		memset(&(wk.doc_cnt[0]),0,n_menu*sizeof(uint32_t));
+		wk.doc_menu.clear();
+		// menu ids may have changed since the proposals were built
+		wk.epoch++;
+		wk.smooth_use = ~0u;
+		wk.menu_use = ~0u;
+	}
+
+	// Add n (+1/-1) to the count of word w served with menu k in the
+	// current doc, keeping the caches of bucket_prepare() in sync.
+	void bucket_update(Worker& wk, uint32_t k, uint32_t w, int32_t n)
+	{
+		Model& m = *wk.m;
+		wk.s_sum -= m.menu_stat[k]*wk.inv[k];
+		wk.r_sum -= beta*wk.doc_cnt[k]*wk.inv[k];
+		m.word_stat.add(k,w,n);
+		m.word_stat_sum[k] += n;
+		wk.doc_cnt[k] += n;
+		wk.inv[k] = 1.0/(m.word_stat_sum[k]+beta*n_word);
+		wk.s_sum += m.menu_stat[k]*wk.inv[k];
+		wk.r_sum += beta*wk.doc_cnt[k]*wk.inv[k];
+		if(n>0 and wk.doc_cnt[k]==1)
+			wk.doc_menu.push_back(k);
+		if(n<0 and wk.doc_cnt[k]==0)
+			remove_value(wk.doc_menu,k);
+		uint32_t n_kw = m.word_stat.get(k,w);
+		if(n>0 and n_kw==1)
+			wk.nz[w].push_back(k);
+		if(n<0 and n_kw==0)
+			remove_value(wk.nz[w],k);
+	}
+
+	static void remove_value(Vec<uint32_t>& x, uint32_t v)
+	{
+		for(uint32_t i=0;i<x.len;i++)
+			if(x[i]==v)
+			{
+				x[i] = x[x.len-1];
+				x.len--;
+				return;
+			}
+	}
+
+	// Count words of doc d per menu
+	void bucket_doc_begin(Worker& wk, uint32_t d)
+	{
+		for(uint32_t t=0;t<table_stat[d].len;t++)
+		{
+			uint32_t k = menu[d][t];
+			if(wk.doc_cnt[k]==0 and table_stat[d][t]>0)
+				wk.doc_menu.push_back(k);
+			wk.doc_cnt[k] += table_stat[d][t];
+		}
+		wk.r_sum = 0;
+		for(uint32_t j=0;j<wk.doc_menu.len;j++)
+			wk.r_sum += beta*wk.doc_cnt[wk.doc_menu[j]]*wk.inv[wk.doc_menu[j]];
+	}
+
+	void bucket_doc_end(Worker& wk)
+	{
+		for(uint32_t j=0;j<wk.doc_menu.len;j++)
+			wk.doc_cnt[wk.doc_menu[j]] = 0;
+		wk.doc_menu.clear();
+	}
+
+	// Put word i of doc d at table t (a new one if t==#table) serving
+	// menu k (a new one if k==~0u), updating the caches.
+	void bucket_assign(Worker& wk, uint32_t d, uint32_t i, uint32_t t, uint32_t k, uint32_t k_old)
+	{
+		Model& m = *wk.m;
+		uint32_t w = st.tokens(d).word(i);
+		if(k==~0u) // New menu!
+		{
+			k = m.add_menu();
+			wk.inv.push_back(1.0/(beta*n_word));
+			wk.doc_cnt.push_back(0);
+		}
+		if(t==table_stat[d].len) // New table in d
+		{
+			add_table(d,k);
+			wk.s_sum += wk.inv[k];
+			m.menu_stat[k]++;
+			m.menu_stat_sum++;
+		}
+		link_word(d,i,t);
+		table_stat[d][t]++;
+		bucket_update(wk,k,w,1);
+		if(wk.logging and k!=k_old)
+		{
+			Delta dl = {k_old,w,-1};
+			wk.log.push_back(dl);
+			Delta dl2 = {k,w,1};
+			wk.log.push_back(dl2);
+		}
+	}
+
+	// Draw a table of doc d serving menu k (or #table for a new one)
+	uint32_t draw_table(Worker& wk, uint32_t d, uint32_t k, double a)
+	{
+		Model& m = *wk.m;
+		double u = wk.rng.drand()*(wk.doc_cnt[k]+a*m.menu_stat[k]);
+		for(uint32_t t=0;t<table_stat[d].len;t++)
+			if(menu[d][t]==k and (u-=table_stat[d][t])<0)
+				return t;
+		return table_stat[d].len;
+	}
+
+	void bucket_doc(Worker& wk, uint32_t d)
+	{
+		Model& m = *wk.m;
+		Vec<double>& p = wk.p;
+		bucket_doc_begin(wk,d);
+		DocState::Tokens x = st.tokens(d);
+		for(uint32_t i=0;i<x.len;i++)
+		{
+			uint32_t w = x.word(i);
+			uint32_t t = x.table(i);
+			uint32_t k = menu[d][t];
+			uint32_t k_old = k;
+			// Remove statistics
+			table_stat[d][t]--;
+			unlink_word(d,i);
+			bucket_update(wk,k,w,-1);
+			// Bucket masses
+			double a = alpha/(m.menu_stat_sum+gamma);
+			double s = a*beta*wk.s_sum;
+			double r = (wk.doc_menu.len>0 and wk.r_sum>0)?wk.r_sum:0;
+			double q = 0;
+			Vec<uint32_t>& nz = wk.nz[w];
+			p.resize(nz.len);
+			uint32_t* col = m.word_stat.column(w);
+			for(uint32_t j=0;j<nz.len;j++)
+			{
+				uint32_t kk = nz[j];
+				uint32_t n_kw = (NULL!=col)?col[kk]:m.word_stat.get(kk,w);
+				p[j] = n_kw*(wk.doc_cnt[kk]+a*m.menu_stat[kk])*wk.inv[kk];
+				q += p[j];
+			}
+			double z = a*gamma/n_word;
+			// Draw the menu
+			double u = wk.rng.drand()*(q+r+s+z);
+			k = ~0u;
+			if(u<q)
+			{
+				for(uint32_t j=0;j<nz.len and k==~0u;j++)
+					if((u-=p[j])<=0)
+						k = nz[j];
+				if(k==~0u)
+					k = nz[nz.len-1];
+			}
+			else if((u-=q)<r)
+			{
+				for(uint32_t j=0;j<wk.doc_menu.len and k==~0u;j++)
+					if((u-=beta*wk.doc_cnt[wk.doc_menu[j]]*wk.inv[wk.doc_menu[j]])<=0)
+						k = wk.doc_menu[j];
+				if(k==~0u)
+					k = wk.doc_menu[wk.doc_menu.len-1];
+			}
+			else if((u-=r)<s)
+			{
+				u /= a*beta;
+				for(uint32_t kk=0;kk<m.menu_stat.len and k==~0u;kk++)
+					if(m.menu_stat[kk]>0 and (u-=m.menu_stat[kk]*wk.inv[kk])<=0)
+						k = kk;
+				for(uint32_t kk=m.menu_stat.len;k==~0u;kk--)
+					if(m.menu_stat[kk-1]>0)
+						k = kk-1;
+			}
+			p.clear();
+			// Draw the table serving menu k
+			t = (k==~0u)?table_stat[d].len:draw_table(wk,d,k,a);
+			bucket_assign(wk,d,i,t,k,k_old);
+		}
+		bucket_doc_end(wk);
+	}
+
+	/**
+	 * Alias sampler (as LightLDA) for the menu mass of bucket_doc():
+	 *   pi(k) = (c_dk + a*m_k) * (n_kw + beta) / (n_k + V*beta),
+	 *   pi(new) = a*gamma/V.
+	 * A Metropolis-Hastings chain of mh_steps alternates between
+	 * - a word proposal ~ (n_kw + beta)/(n_k + V*beta), drawn in O(1)
+	 *   from alias tables built lazily (sparse per word + smoothing)
+	 *   and rebuilt after as many draws as they have entries;
+	 * - a doc proposal ~ c_dk + alpha*m_k/(M+m_new), drawn by taking
+	 *   the menu of another word of the doc, or from an alias table
+	 *   over menus (a new menu has weight m_new, see alias_build_menu).
+	 * Proposal densities are evaluated with the weights the tables
+	 * were built with, so the chain leaves pi invariant.
+	 */
+	enum { MENU_NEW = 0xffffffffu };
+
+	void alias_build_word(Worker& wk, uint32_t w)
+	{
+		Model& m = *wk.m;
+		WordAlias& wa = wk.word_alias[w];
+		wa.menu.copy_from(wk.nz[w]);
+		if(wa.menu.len>1)
+			qsort(&(wa.menu[0]),wa.menu.len,sizeof(uint32_t),cmp_uint32);
+		wa.weight.resize(wa.menu.len);
+		wa.mass = 0;
+		uint32_t* col = m.word_stat.column(w);
+		for(uint32_t j=0;j<wa.menu.len;j++)
+		{
+			uint32_t k = wa.menu[j];
+			wa.weight[j] = ((NULL!=col)?col[k]:m.word_stat.get(k,w))*wk.inv[k];
+			wa.mass += wa.weight[j];
+		}
+		if(wa.menu.len>0)
+			wa.tab.build(&(wa.weight[0]),wa.menu.len);
+		wa.use = 0;
+		wa.epoch = wk.epoch;
+	}
+
+	void alias_build_smooth(Worker& wk)
+	{
+		uint32_t n_menu = wk.m->menu_stat.len;
+		wk.smooth_weight.resize(n_menu);
+		wk.smooth_mass = 0;
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			wk.smooth_weight[k] = beta*wk.inv[k];
+			wk.smooth_mass += wk.smooth_weight[k];
+		}
+		if(n_menu>0)
+			wk.smooth_alias.build(&(wk.smooth_weight[0]),n_menu);
+		wk.smooth_use = 0;
+	}
+
+	void alias_build_menu(Worker& wk)
+	{
+		Model& m = *wk.m;
+		uint32_t n_menu = m.menu_stat.len;
+		wk.menu_weight.resize(n_menu+1);
+		for(uint32_t k=0;k<n_menu;k++)
+			wk.menu_weight[k] = m.menu_stat[k];
+		// Propose a new menu as often as an average one (rather than
+		// ~gamma), or new menus are rarely tried once M is large.
+		double w_new = n_menu>0?(double)m.menu_stat_sum/n_menu:0;
+		wk.menu_weight[n_menu] = w_new>gamma?w_new:gamma;
+		wk.menu_mass = m.menu_stat_sum+wk.menu_weight[n_menu];
+		wk.menu_alias.build(&(wk.menu_weight[0]),n_menu+1);
+		wk.menu_use = 0;
+	}
+
+	// The smoothing and menu tables are also rebuilt once a menu was
+	// added: a menu missing from them has proposal weight 0, so a word
+	// or table at it could not move until the next rebuild.
+	void alias_fresh_smooth(Worker& wk)
+	{
+		if(wk.smooth_use>=wk.smooth_weight.len or wk.smooth_weight.len<wk.m->menu_stat.len)
+			alias_build_smooth(wk);
+	}
+
+	void alias_fresh_menu(Worker& wk)
+	{
+		if(wk.menu_use>=wk.menu_weight.len or wk.menu_weight.len<=wk.m->menu_stat.len)
+			alias_build_menu(wk);
+	}
+
+	// Draw from the menu table, rebuilt after as many draws as entries
+	uint32_t alias_draw_menu(Worker& wk)
+	{
+		wk.menu_use++;
+		uint32_t k = wk.menu_alias.sample(wk.rng.drand());
+		return (k==wk.menu_weight.len-1)?MENU_NEW:k;
+	}
+
+	// Proposal weight of menu k in the menu table
+	double alias_menu_weight(Worker& wk, uint32_t k)
+	{
+		if(k==MENU_NEW)
+			return wk.menu_weight[wk.menu_weight.len-1];
+		return (k<wk.menu_weight.len-1)?wk.menu_weight[k]:0;
+	}
+
+	// Unnormalized word proposal of menu k for word w
+	double alias_word_q(Worker& wk, uint32_t w, uint32_t k)
+	{
+		if(k==MENU_NEW)
+			return 0;
+		double q = wk.word_alias[w].get(k);
+		if(k<wk.smooth_weight.len)
+			q += wk.smooth_weight[k];
+		return q;
+	}
+
+	// Unnormalized doc proposal of menu k for a word of doc d
+	double alias_doc_q(Worker& wk, uint32_t k)
+	{
+		double c = (k==MENU_NEW)?0:wk.doc_cnt[k];
+		return c + alpha*alias_menu_weight(wk,k)/wk.menu_mass;
+	}
+
+	// Target of the MH chain
+	double alias_pi(Worker& wk, uint32_t w, uint32_t k, double a)
+	{
+		Model& m = *wk.m;
+		if(k==MENU_NEW)
+			return a*gamma/n_word;
+		return (wk.doc_cnt[k]+a*m.menu_stat[k])*(m.word_stat.get(k,w)+beta)*wk.inv[k];
+	}
+
+	void alias_doc(Worker& wk, uint32_t d)
+	{
+		if(NULL==wk.word_alias)
+			wk.word_alias = new WordAlias[n_word];
+		bucket_doc_begin(wk,d);
+		DocState::Tokens x = st.tokens(d);
+		for(uint32_t i=0;i<x.len;i++)
+		{
+			uint32_t w = x.word(i);
+			uint32_t t = x.table(i);
+			uint32_t k_old = menu[d][t];
+			// Remove statistics
+			table_stat[d][t]--;
+			unlink_word(d,i);
+			bucket_update(wk,k_old,w,-1);
+			double a = alpha/(wk.m->menu_stat_sum+gamma);
+			uint32_t s = alias_mh(wk,d,i,k_old,a);
+			t = (s==MENU_NEW)?table_stat[d].len:draw_table(wk,d,s,a);
+			bucket_assign(wk,d,i,t,s,k_old);
+		}
+		bucket_doc_end(wk);
+	}
+
+	// Run the MH chain for word i of doc d (removed) from menu s
+	uint32_t alias_mh(Worker& wk, uint32_t d, uint32_t i, uint32_t s, double a)
+	{
+		DocState::Tokens x = st.tokens(d);
+		uint32_t w = x.word(i);
+		WordAlias& wa = wk.word_alias[w];
+		double pi_s = alias_pi(wk,w,s,a);
+		for(uint32_t step=0;step<mh_steps;step++)
+		{
+			uint32_t k;
+			double q_s, q_k;
+			if(step%2==0) // word proposal
+			{
+				if(wa.epoch!=wk.epoch or wa.use>=wa.menu.len)
+					alias_build_word(wk,w);
+				alias_fresh_smooth(wk);
+				wa.use++;
+				wk.smooth_use++;
+				double u = wk.rng.drand()*(wa.mass+wk.smooth_mass);
+				if(u<wa.mass)
+					k = wa.menu[wa.tab.sample(u/wa.mass)];
+				else
+					k = wk.smooth_alias.sample(wk.rng.drand());
+				q_s = alias_word_q(wk,w,s);
+				q_k = alias_word_q(wk,w,k);
+			}
+			else // doc proposal
+			{
+				alias_fresh_menu(wk);
+				uint32_t n_d = x.len-1;
+				double u = wk.rng.drand()*(n_d+alpha);
+				if(u<n_d)
+				{
+					uint32_t j = (uint32_t)u;
+					j += (j>=i);
+					k = menu[d][x.table(j)];
+				}
+				else
+					k = alias_draw_menu(wk);
+				q_s = alias_doc_q(wk,s);
+				q_k = alias_doc_q(wk,k);
+			}
+			if(k==s)
+				continue;
+			double pi_k = alias_pi(wk,w,k,a);
+			if(pi_s==0 or wk.rng.drand()*pi_s*q_k<pi_k*q_s)
+			{
+				s = k;
+				pi_s = pi_k;
+			}
+		}
+		return s;
+	}
+
+	static int cmp_uint32(const void* a, const void* b)
+	{
+		uint32_t x = *(const uint32_t*)a;
+		uint32_t y = *(const uint32_t*)b;
+		return (x>y)-(x<y);
 	}
 
-	void config(double a, double b, double g, uint32_t buffer_size=65536*128)
+	// Resample menus of the tables of docs first,...,n_doc-1
+	void gibbs_menu(uint32_t first=0)
 	{
-		alpha = a;
-		beta = b;
-		gamma = g;
+		Vec<uint32_t> part;
+		const uint32_t* x = doc_order(menu_order,part,first);
+		if(n_thread>1 and sampler!=SAMPLER_ALIAS)
+		{
+			gibbs_menu_batch(x,n_doc-first);
+			return;
+		}
+		worker[0].menu_use = ~0u;
+		for(uint32_t d=0;d<n_doc-first;d++)
+		{
+			doc_rng(worker[0],x[d],RNG_MENU);
+			for(uint32_t t=0;t<menu[x[d]].len;t++)
+				if(sampler==SAMPLER_ALIAS)
+					reassign_table_mh(worker[0],x[d],t);
+				else
+					reassign_table(x[d],t);
+		}
+	}
 
-		pct_log.make(buffer_size,log,0);
-		pct_log_b.make(buffer_size,log,beta);
-		pct_log_nb.make(buffer_size,log,beta*n_word);
-		pct_log_g.make(buffer_size,log,gamma);
+	/**
+	 * gibbs_menu() with threads, over batches of docs with about
+	 * MENU_BATCH tables per thread. The workers score all the tables
+	 * of a batch (as reassign_table(), O(#words*K) each) against the
+	 * counts at its start, then the batch is committed in order:
+	 * - MENU_EXACT: the scores of the menus changed by earlier tables
+	 *   of the batch (and of the new ones) are recomputed, and the
+	 *   draw is made then, so the samples are those of one thread;
+	 * - MENU_DELAYED: the workers draw from the stale scores and the
+	 *   moves are only applied (a new menu for each table drawing one).
+	 * With MENU_EXACT, batches shrink while the commits change more
+	 * than a quarter of the menus (as with few menus), and grow back
+	 * when they change less than an eighth.
+	 */
+	void gibbs_menu_batch(const uint32_t* x, uint32_t n)
+	{
+		MenuBatch& b = batch;
+		uint32_t max_len = MENU_BATCH*n_thread;
+		if(b.len==0 or b.len>max_len)
+			b.len = max_len;
+		// Workers 1,... wait at the barrier for each batch, worker 0
+		// is this thread
+		b.stop = false;
+		pthread_barrier_init(&b.barrier,NULL,n_thread);
+		pthread_t* th = (pthread_t*)malloc(n_thread*sizeof(pthread_t));
+		for(uint32_t j=1;j<n_thread;j++)
+			if(pthread_create(&th[j],NULL,gibbs_menu_thread,&worker[j]))
+				error("Cannot create thread %u.\n",j);
+		for(uint32_t d0=0,d1=0;d0<n;d0=d1)
+		{
+			// Docs x[d0..d1), with the first row of each
+			uint32_t n_t = 0;
+			uint64_t n_token = 0;
+			b.row.clear();
+			for(d1=d0;d1<n and n_t<b.len;d1++)
+			{
+				b.row.push_back(n_t);
+				n_t += menu[x[d1]].len;
+				n_token += dat[x[d1]].len;
+			}
+			b.row.push_back(n_t);
+			b.n_menu = menu_stat.len;
+			b.score.resize(n_t*(b.n_menu+1));
+			b.res.resize(n_t);
+			// Shares of the workers, by number of words
+			uint64_t acc = 0;
+			uint32_t d = d0;
+			for(uint32_t j=0;j<n_thread;j++)
+			{
+				Worker& wk = worker[j];
+				wk.order = x+d0;
+				wk.begin = d-d0;
+				while(d<d1 and acc*n_thread<n_token*(j+1))
+					acc += dat[x[d++]].len;
+				wk.end = (j==n_thread-1)?d1-d0:d-d0;
+			}
+			pthread_barrier_wait(&b.barrier);
+			menu_score_share(worker[0]);
+			pthread_barrier_wait(&b.barrier);
+			// Commit
+			b.dirty.resize(b.n_menu);
+			if(b.n_menu>0)
+				memset(&(b.dirty[0]),0,b.n_menu*sizeof(uint32_t));
+			b.dirty_menu.clear();
+			for(uint32_t i=0;i<d1-d0;i++)
+			{
+				uint32_t d = x[d0+i];
+				if(menu_commit==MENU_EXACT)
+					doc_rng(worker[0],d,RNG_MENU);
+				for(uint32_t t=0;t<menu[d].len;t++)
+				{
+					uint32_t r = b.row[i]+t;
+					if(menu_commit==MENU_EXACT)
+						commit_exact(d,t,&(b.score[(uint64_t)r*(b.n_menu+1)]));
+					else
+						commit_delayed(d,t,b.res[r]);
+				}
+			}
+			if(menu_commit==MENU_EXACT and 4*b.dirty_menu.len>b.n_menu)
+				b.len = (b.len/2>n_thread)?b.len/2:n_thread;
+			else if(8*b.dirty_menu.len<b.n_menu)
+				b.len = (2*b.len<max_len)?2*b.len:max_len;
+		}
+		b.stop = true;
+		pthread_barrier_wait(&b.barrier);
+		for(uint32_t j=1;j<n_thread;j++)
+			pthread_join(th[j],NULL);
+		free(th);
+		pthread_barrier_destroy(&b.barrier);
 	}
 
-	void add_entry(uint32_t doc, uint32_t word)
+	static void* gibbs_menu_thread(void* arg)
 	{
-		qassert(doc<n_doc);
-		qassert(word<n_word);
-		dat[doc].push_back(word);
+		Worker& wk = *(Worker*)arg;
+		HDP& h = *wk.hdp;
+		for(;;)
+		{
+			pthread_barrier_wait(&h.batch.barrier);
+			if(h.batch.stop)
+				break;
+			h.menu_score_share(wk);
+			pthread_barrier_wait(&h.batch.barrier);
+		}
+		return NULL;
 	}
 
-	void read_data(const char* filename) // in lda-c format
+	// Scores (and draws with MENU_DELAYED) of the tables of the docs
+	// of worker wk in the batch
+	void menu_score_share(Worker& wk)
 	{
-		FILE * f = fopen(filename,"r");
-		if(!f)
-			error("Cannot open %s for reading.\n",filename);
-		for(uint32_t d=0;d<n_doc;d++)
+		MenuBatch& b = batch;
+		uint32_t len = b.n_menu+1;
+		for(uint32_t i=wk.begin;i<wk.end;i++)
 		{
-			uint32_t n,w,m;
-			qassert(1==fscanf(f,"%u ",&n));
-			for(uint32_t i=0;i<n;i++)
+			uint32_t d = wk.order[i];
+			if(menu_commit==MENU_DELAYED)
+				doc_rng(wk,d,RNG_MENU);
+			for(uint32_t t=0;t<menu[d].len;t++)
 			{
-				qassert(2==fscanf(f,"%u:%u",&w,&m));
-				for(uint32_t j=0;j<m;j++)
-					add_entry(d,w);
+				uint32_t r = b.row[i]+t;
+				double* p = &(b.score[(uint64_t)r*len]);
+				menu_score(wk,d,t,p);
+				if(menu_commit==MENU_DELAYED)
+				{
+					wk.q.resize(len);
+					prop_exp(p,len);
+					b.res[r] = rmultinorm_r(&wk.rng,p,&(wk.q[0]),len);
+				}
 			}
 		}
 	}
 
-	void init0()
+	// Scores p[0..n_menu] of reassign_table(d,t), without changing the
+	// counts: those of the menu of the table are taken as if it left
+	void menu_score(Worker& wk, uint32_t d, uint32_t t, double* p)
 	{
-		// 1 table for a doc, 1 menu for the franchise.
-		word_stat.push_back((uint32_t*)malloc(n_word*sizeof(uint32_t)));
-		memset(word_stat[0],0,n_word*sizeof(uint32_t));
-		word_stat_sum.push_back(0);
-		menu_stat.push_back(0);
-		for(uint32_t d=0;d<n_doc;d++)
+		uint32_t n_menu = batch.n_menu;
+		uint32_t k_old = menu[d][t];
+		uint32_t n_t = table_stat[d][t];
+		Vec<uint32_t>& words = wk.words;
+		table_words(wk,d,t);
+		for(uint32_t k=0;k<n_menu;k++)
+			p[k] = pct_log(menu_stat[k]);
+		p[n_menu] = pct_log_g(0);
+		local_stat_init(wk);
+		uint32_t* local = &(wk.local_stat[0]);
+		for(uint32_t j=0;j<words.len;j++)
 		{
-			table_stat[d].push_back(0);
-			menu[d].push_back(0); //menu[d][table[d][i]];
-			menu_stat[0]++;
-			menu_stat_sum++;
-			for(uint32_t i=0;i<dat[d].len;i++)
+			uint32_t w = words[j];
+			uint32_t* col = word_stat.column(w);
+			for(uint32_t k=0;k<n_menu;k++)
 			{
-				table[d].push_back(0); // table[d][i]
-				word_stat[0][dat[d][i]]++; //dat[d][i].n;
-				word_stat_sum[0]++; //dat[d][i].n;
-				table_stat[d][0]++; //dat[d][i].n;
+				uint32_t n_kw = (NULL!=col)?col[k]:word_stat.get(k,w);
+				p[k] += pct_log_b(n_kw+local[w]) - pct_log_nb(word_stat_sum[k]+j);
 			}
+			p[n_menu] += pct_log_b(local[w]) - pct_log_nb(j);
+			local[w]++;
+		}
+		// Menu k_old again without the table: local[w] is the count of
+		// w in words[j..], so n_kw-local[w] the one of reassign_table()
+		p[k_old] = pct_log(menu_stat[k_old]-1);
+		for(uint32_t j=0;j<words.len;j++)
+		{
+			uint32_t w = words[j];
+			p[k_old] += pct_log_b(word_stat.get(k_old,w)-local[w]) - pct_log_nb(word_stat_sum[k_old]-n_t+j);
+			local[w]--;
 		}
 	}
 
-	void init()
+	// reassign_table(d,t) with the scores s of menu_score() at the start
+	// of the batch, fixed for the menus changed since
+	void commit_exact(uint32_t d, uint32_t t, const double* s)
 	{
-		static Vec<uint32_t> x(n_doc);
-		if(x.len==0)
-			for(uint32_t d=0;d<n_doc;d++)
-				x.push_back(d);
-		shuffle(&(x[0]),n_doc);
-		for(uint32_t di=0;di<n_doc;di++)
-			for(uint32_t i=0;i<dat[x[di]].len;i++)
-			{
-				uint32_t d = x[di];
-				// assign_user(d,i)
-				reassign_user(d,i,true);
-			}
+		MenuBatch& b = batch;
+		Worker& wk = worker[0];
+		Vec<double>& p = wk.p;
+		Vec<double>& q = wk.q;
+		Vec<uint32_t>& words = wk.words;
+		uint32_t k_old = menu[d][t];
+		table_words(wk,d,t);
+		for(uint32_t j=0;j<words.len;j++)
+			word_stat.dec(k_old,words[j]);
+		word_stat_sum[k_old] -= table_stat[d][t];
+		menu_stat[k_old]--;
+		menu_stat_sum--;
+		uint32_t n_menu = menu_stat.len;
+		p.resize(n_menu+1);
+		q.resize(n_menu+1);
+		memcpy(&(p[0]),s,b.n_menu*sizeof(double));
+		p[n_menu] = s[b.n_menu];
+		local_stat_init(wk);
+		for(uint32_t j=0;j<b.dirty_menu.len;j++)
+		{
+			uint32_t k = b.dirty_menu[j];
+			p[k] = table_loglik(wk,k,pct_log(menu_stat[k]));
+		}
+		for(uint32_t k=b.n_menu;k<n_menu;k++)
+			p[k] = table_loglik(wk,k,pct_log(menu_stat[k]));
+		prop_exp(&(p[0]),p.len);
+		uint32_t res = rmultinorm_r(&wk.rng,&(p[0]),&(q[0]),p.len);
+		p.clear();
+		q.clear();
+		menu[d][t] = res;
+		if(res==n_menu)
+			add_menu();
+		menu_stat[res]++;
+		menu_stat_sum++;
+		for(uint32_t j=0;j<words.len;j++)
+			word_stat.inc(res,words[j]);
+		word_stat_sum[res] += table_stat[d][t];
+		if(res!=k_old)
+		{
+			mark_dirty(k_old);
+			mark_dirty(res);
+		}
 	}
 
-	void gibbs_table() 
+	void mark_dirty(uint32_t k)
 	{
-		static Vec<uint32_t> x(n_doc);
-		if(x.len==0)
-			for(uint32_t d=0;d<n_doc;d++)
-				x.push_back(d);
-		shuffle(&(x[0]),n_doc);
-		for(uint32_t d=0;d<n_doc;d++)
-			for(uint32_t i=0;i<dat[x[d]].len;i++)
-				reassign_user(x[d],i);
+		if(k<batch.n_menu and 0==batch.dirty[k])
+		{
+			batch.dirty[k] = 1;
+			batch.dirty_menu.push_back(k);
+		}
 	}
 
-	void reassign_user(uint32_t d, uint32_t i, bool firstrun=false)
+	// Move table t of doc d to menu k drawn by a worker (n_menu: new)
+	void commit_delayed(uint32_t d, uint32_t t, uint32_t k)
 	{
-		static Vec<double> p; // prob without normalization
-		static Vec<double> q; // cum prob to be filled by rmult()
-		double lprob_t, lprob_k;
-		uint32_t w = dat[d][i];
-		// Remove statistics
-		if(not firstrun) {
-			uint32_t t = table[d][i];
-			uint32_t k = menu[d][t];
-			word_stat[k][w]--; //dat[d][i].n;
-			word_stat_sum[k]--; //dat[d][i].n;
-			table_stat[d][t]--; //dat[d][i].n;
+		uint32_t k_old = menu[d][t];
+		if(k==k_old)
+			return;
+		Vec<uint32_t>& words = worker[0].words;
+		table_words(worker[0],d,t);
+		if(k==batch.n_menu)
+			k = add_menu();
+		for(uint32_t j=0;j<words.len;j++)
+		{
+			word_stat.dec(k_old,words[j]);
+			word_stat.inc(k,words[j]);
 		}
-		// 1. Take an existing table.
-		for(uint32_t t=0;t<table_stat[d].len;t++)
+		word_stat_sum[k_old] -= table_stat[d][t];
+		word_stat_sum[k] += table_stat[d][t];
+		menu_stat[k_old]--;
+		menu_stat[k]++;
+		menu[d][t] = k;
+	}
+
+	void local_stat_init(Worker& wk)
+	{
+		if(wk.local_stat.len!=n_word)
 		{
-			lprob_t = pct_log(table_stat[d][t]);
-			p.push_back(lprob_t);
-			q.push_back(0);
-			// g_k = P(w_di | t_di)
-			uint32_t k = menu[d][t];
-			p[t] += pct_log_b(word_stat[k][w]) - pct_log_nb(word_stat_sum[k]);
+			wk.local_stat.resize(n_word);
+			memset(&(wk.local_stat[0]),0,n_word*sizeof(uint32_t));
 		}
-		// 2. Take a new table with an existing menu.
-		lprob_t = log(alpha);
-		for(uint32_t k=0;k<menu_stat.len;k++)
+	}
+
+	// Log-likelihood of the words in wk.words under menu k
+	// (MENU_NEW for a new one) added to l, wk.local_stat must be all 0.
+	double table_loglik(Worker& wk, uint32_t k, double l=0)
+	{
+		Vec<uint32_t>& words = wk.words;
+		uint32_t* local = &(wk.local_stat[0]);
+		for(uint32_t j=0;j<words.len;j++)
 		{
-			lprob_k = pct_log(menu_stat[k]) - pct_log_g(menu_stat_sum);
-			p.push_back(lprob_t+lprob_k);
-			q.push_back(0);
-			p[p.len-1] += pct_log_b(word_stat[k][w]) - pct_log_nb(word_stat_sum[k]);
+			uint32_t w = words[j];
+			if(k==MENU_NEW)
+				l += pct_log_b(local[w]) - pct_log_nb(j);
+			else
+				l += pct_log_b(word_stat.get(k,w)+local[w]) - pct_log_nb(word_stat_sum[k]+j);
+			local[w]++; // for duplicated word
 		}
-		// 3. Take a new table with a new menu.
-		lprob_k = pct_log_g(0) - pct_log_g(menu_stat_sum);
-		p.push_back(lprob_t + lprob_k);
-		q.push_back(0);
-		p[p.len-1] += -pct_log(n_word);
-		// Exponetial
-		prop_exp(&p[0],p.len);
-		// Draw random number
-		uint32_t res = rmultinorm(&p[0],&q[0],p.len);
-		p.clear();
-		q.clear();
-		uint32_t res_t = res<table_stat[d].len?res:table_stat[d].len;
-		if(firstrun)
-			table[d].push_back(0);
-		table[d][i] = res_t;
-		if(res_t==table_stat[d].len) // New table in d
+		for(uint32_t j=0;j<words.len;j++)
+			local[words[j]] = 0;
+		return l;
+	}
+
+	/**
+	 * Metropolis-Hastings version of reassign_table(): menus are
+	 * proposed from the menu alias table (~ menu_stat[k]), so each
+	 * step costs O(#words at the table), not O(K).
+	 */
+	void reassign_table_mh(Worker& wk, uint32_t d, uint32_t t)
+	{
+		uint32_t k_old = menu[d][t];
+		Vec<uint32_t>& words = wk.words;
+		table_words(wk,d,t);
+		local_stat_init(wk);
+		// Remove statistics
+		for(uint32_t j=0;j<words.len;j++)
+			word_stat.dec(k_old,words[j]);
+		word_stat_sum[k_old] -= table_stat[d][t];
+		menu_stat[k_old]--;
+		menu_stat_sum--;
+		// A menu left without tables is the same as a new one, so start
+		// the chain there (proposing a new menu is rare).
+		uint32_t s = (menu_stat[k_old]>0)?k_old:MENU_NEW;
+		double pi_s = ((s==MENU_NEW)?pct_log_g(0):pct_log(menu_stat[s])) + table_loglik(wk,s);
+		for(uint32_t step=0;step<mh_steps;step++)
 		{
-			uint32_t res_k = res - table_stat[d].len;
-			table_stat[d].push_back(0);
-			menu[d].push_back(res_k);
-			if(res_k==menu_stat.len) // New menu!
+			alias_fresh_menu(wk);
+			uint32_t k = alias_draw_menu(wk);
+			if(k==s)
+				continue;
+			double pi_k = (k==MENU_NEW)?pct_log_g(0):pct_log(menu_stat[k]);
+			pi_k += table_loglik(wk,k);
+			double q_s = log(alias_menu_weight(wk,s));
+			double q_k = log(alias_menu_weight(wk,k));
+			if(log(wk.rng.drand())<pi_k-pi_s+q_s-q_k)
 			{
-				word_stat.push_back((uint32_t*)malloc(n_word*sizeof(uint32_t)));
-				memset(word_stat[word_stat.len-1],0,n_word*sizeof(uint32_t));
-				word_stat_sum.push_back(0);
-				menu_stat.push_back(0);
+				s = k;
+				pi_s = pi_k;
 			}
-			// Update for New table
-			menu_stat[res_k]++;
-			menu_stat_sum++;
 		}
+		if(s==MENU_NEW)
+			s = (menu_stat[k_old]==0)?k_old:add_menu();
+		menu[d][t] = s;
 		// Update statistics
-		if(true) {
-			uint32_t t = table[d][i];
-			uint32_t k = menu[d][t];
-			word_stat[k][w]++;//dat[d][i].n;
-			word_stat_sum[k]++;//dat[d][i].n;
-			table_stat[d][t]++;//dat[d][i].n;
-		}
-	}
-
-	void gibbs_menu()
-	{
-		static Vec<uint32_t> x(n_doc);
-		if(x.len==0)
-			for(uint32_t d=0;d<n_doc;d++)
-				x.push_back(d);
-		shuffle(&(x[0]),n_doc);
-		for(uint32_t d=0;d<n_doc;d++)
-			for(uint32_t t=0;t<menu[x[d]].len;t++)
-				reassign_table(x[d],t);
+		for(uint32_t j=0;j<words.len;j++)
+			word_stat.inc(s,words[j]);
+		word_stat_sum[s] += table_stat[d][t];
+		menu_stat[s]++;
+		menu_stat_sum++;
 	}
 	
 	void reassign_table(uint32_t d, uint32_t t)
 	{
-		static Vec<double> p;
-		static Vec<double> q;
+		Vec<double>& p = worker[0].p;
+		Vec<double>& q = worker[0].q;
+		Vec<uint32_t>& words = worker[0].words;
+		table_words(worker[0],d,t);
 		if(true) //Remove statistics
 		{
 			uint32_t k = menu[d][t];
-			for(uint32_t i=0;i<dat[d].len;i++)
-				if(table[d][i]==t)
-					word_stat[k][dat[d][i]]--;//dat[d][i].n;
+			for(uint32_t j=0;j<words.len;j++)
+				word_stat.dec(k,words[j]);//dat[d][i].n;
 			word_stat_sum[k] -= table_stat[d][t];
 			menu_stat[k]--;
 			menu_stat_sum--;
@@ -285,47 +1600,344 @@ public:
 		p.push_back(pct_log_g(0));
 		q.push_back(0);
 		// calculate g_k
-		static Vec<uint32_t> local_stat(n_word);
-		local_stat.len = n_word;
-		memset(&(local_stat[0]),0,n_word*sizeof(uint32_t));
-		uint32_t j = 0;
-		for(uint32_t i=0;i<dat[d].len;i++) 
-			if(table[d][i]==t)
-			{
-				for(uint32_t k=0;k<menu_stat.len;k++)
-					p[k] += pct_log_b(word_stat[k][dat[d][i]]+local_stat[dat[d][i]]) - pct_log_nb(word_stat_sum[k]+j);
-				p[menu_stat.len] += pct_log_b(local_stat[dat[d][i]]) - pct_log_nb(j);
-				local_stat[dat[d][i]]++; // for duplicated word
-				j++;
+		Vec<uint32_t>& local_stat = worker[0].local_stat;
+		local_stat_init(worker[0]);
+		for(uint32_t j=0;j<words.len;j++)
+		{
+			uint32_t w = words[j];
+			uint32_t* col = word_stat.column(w);
+			for(uint32_t k=0;k<menu_stat.len;k++)
+			{
+				uint32_t n_kw = (NULL!=col)?col[k]:word_stat.get(k,w);
+				p[k] += pct_log_b(n_kw+local_stat[w]) - pct_log_nb(word_stat_sum[k]+j);
 			}
+			p[menu_stat.len] += pct_log_b(local_stat[w]) - pct_log_nb(j);
+			local_stat[w]++; // for duplicated word
+		}
+		for(uint32_t j=0;j<words.len;j++)
+			local_stat[words[j]] = 0;
 		prop_exp(&(p[0]),p.len);
 		// Draw random number
-		uint32_t res = rmultinorm(&(p[0]),&(q[0]),p.len);
+		uint32_t res = rmultinorm_r(&worker[0].rng,&(p[0]),&(q[0]),p.len);
 		p.clear();
 		q.clear();
 		menu[d][t] = res;
 		if(res==menu_stat.len)
-		{
-			word_stat.push_back((uint32_t*)malloc(n_word*sizeof(uint32_t)));
-			memset(&(word_stat[word_stat.len-1][0]),0,n_word*sizeof(uint32_t));
-			word_stat_sum.push_back(0);
-			menu_stat.push_back(0);
-		}
+			add_menu();
 		if(true) // Update statistics
 		{
 			menu_stat[res]++;
 			menu_stat_sum++;
-			for(uint32_t i=0;i<dat[d].len;i++)
-				if(table[d][i]==t)
-					word_stat[res][dat[d][i]]++; //=dat[d][i].n;
+			for(uint32_t j=0;j<words.len;j++)
+				word_stat.inc(res,words[j]); //=dat[d][i].n;
 			word_stat_sum[res] += table_stat[d][t];
 		}
 	}
 
-	void remove_empty()
+	/**
+	 * Sequentially-allocated split-merge moves over menus (Dahl, 2005),
+	 * with the seating of words fixed. Pair i draws two tables from
+	 * stream (i,n_sweep,RNG_SPLIT); if they share a menu, its tables are
+	 * split between it and a new menu, each in random order to one side
+	 * with prob ~ #tables*p(words of the table | side), otherwise the two
+	 * menus are merged. The move is accepted with the MH ratio of
+	 *   gamma^K prod_k Gamma(m_k) * prod_k DirMult(words of menu k)
+	 * over the proposal. Pairs run in waves of disjoint menus, over the
+	 * threads, with the same results for any number of threads. Empty
+	 * menus are left to remove_empty(). Returns the number of moves.
+	 */
+	uint32_t split_merge(uint32_t n_pair)
+	{
+		if(NULL!=word_stat.journal)
+			error("Split-merge is not supported with -server\n");
+		sm_index();
+		if(sm_table.len<2)
+			return 0;
+		sm_pair.resize(n_pair);
+		for(uint32_t i=0;i<n_pair;i++)
+		{
+			Rng& r = worker[0].rng;
+			r.set(seed,i,(uint32_t)n_sweep,RNG_SPLIT);
+			uint32_t x = r.drand()*sm_table.len;
+			uint32_t y = r.drand()*(sm_table.len-1);
+			sm_pair[i].a[0] = sm_table[x];
+			sm_pair[i].a[1] = sm_table[y<x?y:y+1];
+			sm_pair[i].accept = false;
+		}
+		// Waves: the pending pairs in order whose menus are not taken
+		Vec<uint32_t> pending;
+		Vec<uint8_t> busy;
+		for(uint32_t i=0;i<n_pair;i++)
+			pending.push_back(i);
+		uint32_t n_move = 0;
+		while(pending.len>0)
+		{
+			sm_wave.clear();
+			busy.resize(menu_stat.len);
+			memset(&(busy[0]),0,busy.len);
+			uint32_t n_left = 0;
+			for(uint32_t j=0;j<pending.len;j++)
+			{
+				SplitPair& sp = sm_pair[pending[j]];
+				for(uint32_t e=0;e<2;e++)
+					sp.k[e] = menu[sp.a[e]>>32][(uint32_t)sp.a[e]];
+				if(busy[sp.k[0]] or busy[sp.k[1]])
+					pending[n_left++] = pending[j];
+				else
+				{
+					busy[sp.k[0]] = busy[sp.k[1]] = 1;
+					sm_wave.push_back(pending[j]);
+				}
+			}
+			pending.len = n_left;
+			for(uint32_t j=0;j<sm_wave.len;j++)
+			{
+				SplitPair& sp = sm_pair[sm_wave[j]];
+				sp.k_new = (sp.k[0]==sp.k[1])?add_menu():~0u;
+			}
+			sm_index();
+			if(n_thread==1 or sm_wave.len==1)
+				split_merge_thread(&worker[0]);
+			else
+			{
+				pthread_t* th = (pthread_t*)malloc(n_thread*sizeof(pthread_t));
+				for(uint32_t j=0;j<n_thread;j++)
+					if(pthread_create(&th[j],NULL,split_merge_thread,&worker[j]))
+						error("Cannot create thread %u.\n",j);
+				for(uint32_t j=0;j<n_thread;j++)
+					pthread_join(th[j],NULL);
+				free(th);
+			}
+			for(uint32_t j=0;j<sm_wave.len;j++)
+				n_move += sm_pair[sm_wave[j]].accept;
+		}
+		return n_move;
+	}
+
+	// Pairs j, j+n_thread, ... of the wave (j: the worker)
+	static void* split_merge_thread(void* arg)
+	{
+		Worker& wk = *(Worker*)arg;
+		HDP& h = *wk.hdp;
+		uint32_t step = (h.n_thread==1 or h.sm_wave.len==1)?1:h.n_thread;
+		h.local_stat_init(wk);
+		for(uint32_t j=&wk-h.worker;j<h.sm_wave.len;j+=step)
+		{
+			SplitPair& sp = h.sm_pair[h.sm_wave[j]];
+			if(sp.k[0]==sp.k[1])
+				h.split_menu(wk,sp);
+			else
+				h.merge_menus(wk,sp);
+		}
+		return NULL;
+	}
+
+	// Tables of each menu (sm_start, sm_table)
+	void sm_index()
 	{
-		// Remove empty tables
+		uint32_t n_menu = menu_stat.len;
+		sm_start.resize(n_menu+1);
+		memset(&(sm_start[0]),0,(n_menu+1)*sizeof(uint32_t));
+		for(uint32_t d=0;d<n_doc;d++)
+			for(uint32_t t=0;t<table_stat[d].len;t++)
+				if(table_stat[d][t]>0)
+					sm_start[menu[d][t]+1]++;
+		for(uint32_t k=0;k<n_menu;k++)
+			sm_start[k+1] += sm_start[k];
+		sm_table.resize(sm_start[n_menu]);
 		for(uint32_t d=0;d<n_doc;d++)
+			for(uint32_t t=0;t<table_stat[d].len;t++)
+				if(table_stat[d][t]>0)
+					sm_table[sm_start[menu[d][t]]++] = (uint64_t)d<<32|t;
+		for(uint32_t k=n_menu;k>0;k--)
+			sm_start[k] = sm_start[k-1];
+		sm_start[0] = 0;
+	}
+
+	// Words of table x (d<<32|t) to wk.words
+	void sm_words(Worker& wk, uint64_t x)
+	{
+		table_words(wk,x>>32,(uint32_t)x);
+	}
+
+	// Words of table x added n times to menu k (wk.words filled if fill)
+	void sm_move(Worker& wk, uint64_t x, uint32_t k, int32_t n, bool fill=true)
+	{
+		if(fill)
+			sm_words(wk,x);
+		for(uint32_t j=0;j<wk.words.len;j++)
+			word_stat.add(k,wk.words[j],n);
+		word_stat_sum[k] += n*(int32_t)wk.words.len;
+	}
+
+	// Tables of menus k0 and k1 but the anchors, in random order
+	void sm_shuffle(Worker& wk, const SplitPair& sp)
+	{
+		wk.sm_order.clear();
+		for(uint32_t e=0;e<2 and (0==e or sp.k[0]!=sp.k[1]);e++)
+			for(uint32_t i=sm_start[sp.k[e]];i<sm_start[sp.k[e]+1];i++)
+				if(sm_table[i]!=sp.a[0] and sm_table[i]!=sp.a[1])
+					wk.sm_order.push_back(sm_table[i]);
+		for(uint32_t i=0;i+1<wk.sm_order.len;i++)
+		{
+			uint32_t j = i+wk.rng.drand()*(wk.sm_order.len-i);
+			uint64_t x = wk.sm_order[i];
+			wk.sm_order[i] = wk.sm_order[j];
+			wk.sm_order[j] = x;
+		}
+		wk.sm_side.resize(wk.sm_order.len);
+	}
+
+	/**
+	 * Allocate the anchors, then the tables of wk.sm_order, to menus
+	 * k[0] and k[1] (whose rows are empty): to the sides of wk.sm_side if
+	 * replay, drawn otherwise. Returns log prob of the allocation, adds
+	 * log CRP*DirMult of side e to l[e].
+	 */
+	double sm_allocate(Worker& wk, const uint32_t* k, const uint64_t* a, bool replay, double* l)
+	{
+		uint32_t n[2] = {1,1};
+		for(uint32_t e=0;e<2;e++)
+		{
+			sm_words(wk,a[e]);
+			l[e] += table_loglik(wk,k[e]);
+			sm_move(wk,a[e],k[e],1,false);
+		}
+		double lq = 0;
+		for(uint32_t i=0;i<wk.sm_order.len;i++)
+		{
+			double li[2];
+			sm_words(wk,wk.sm_order[i]);
+			for(uint32_t e=0;e<2;e++)
+				li[e] = pct_log(n[e])+table_loglik(wk,k[e]);
+			double p0 = 1/(1+exp(li[1]-li[0]));
+			if(!replay)
+				wk.sm_side[i] = (wk.rng.drand()<p0)?0:1;
+			uint32_t e = wk.sm_side[i];
+			lq += log(e==0?p0:1-p0);
+			l[e] += li[e];
+			n[e]++;
+			sm_move(wk,wk.sm_order[i],k[e],1,false);
+		}
+		return lq;
+	}
+
+	// Menu sp.k[0] split with sp.k_new (see split_merge())
+	void split_menu(Worker& wk, SplitPair& sp)
+	{
+		uint32_t k = sp.k[0];
+		sm_rng(wk,sp);
+		sm_shuffle(wk,sp);
+		// Take the tables out, with log CRP*DirMult of the menu
+		double l_old = 0;
+		uint32_t n = sm_start[k+1]-sm_start[k];
+		for(uint32_t i=sm_start[k];i<sm_start[k+1];i++)
+		{
+			sm_move(wk,sm_table[i],k,-1);
+			l_old += table_loglik(wk,k); // given the tables left
+			if(--n>0)
+				l_old += pct_log(n);
+		}
+		uint32_t kk[2] = {k,sp.k_new};
+		double l[2] = {0,0};
+		double lq = sm_allocate(wk,kk,sp.a,false,l);
+		double r = log(gamma)+l[0]+l[1]-l_old-lq;
+		sp.accept = log(wk.rng.drand())<r;
+		uint32_t m[2] = {1,1};
+		for(uint32_t i=0;i<wk.sm_order.len;i++)
+		{
+			uint32_t e = wk.sm_side[i];
+			m[e]++;
+			if(e==0)
+				continue;
+			if(sp.accept)
+				menu[wk.sm_order[i]>>32][(uint32_t)wk.sm_order[i]] = kk[1];
+			else
+			{
+				sm_move(wk,wk.sm_order[i],kk[1],-1);
+				sm_move(wk,wk.sm_order[i],k,1,false);
+			}
+		}
+		if(sp.accept)
+		{
+			menu[sp.a[1]>>32][(uint32_t)sp.a[1]] = kk[1];
+			menu_stat[k] = m[0];
+			menu_stat[kk[1]] = m[1];
+		}
+		else
+		{
+			sm_move(wk,sp.a[1],kk[1],-1);
+			sm_move(wk,sp.a[1],k,1,false);
+		}
+	}
+
+	// Menus sp.k[0] and sp.k[1] merged in sp.k[0] (see split_merge())
+	void merge_menus(Worker& wk, SplitPair& sp)
+	{
+		sm_rng(wk,sp);
+		sm_shuffle(wk,sp);
+		for(uint32_t i=0;i<wk.sm_order.len;i++)
+		{
+			uint32_t d = wk.sm_order[i]>>32, t = (uint32_t)wk.sm_order[i];
+			wk.sm_side[i] = (menu[d][t]==sp.k[0])?0:1;
+		}
+		// Take the tables out, then back as the split would allocate them
+		for(uint32_t e=0;e<2;e++)
+			for(uint32_t i=sm_start[sp.k[e]];i<sm_start[sp.k[e]+1];i++)
+				sm_move(wk,sm_table[i],sp.k[e],-1);
+		double l[2] = {0,0};
+		double lq = sm_allocate(wk,sp.k,sp.a,true,l);
+		// Tables of k[1] moved to k[0]
+		uint32_t k = sp.k[0];
+		uint32_t n = sm_start[k+1]-sm_start[k];
+		double l_new = l[0];
+		for(uint32_t i=sm_start[sp.k[1]];i<sm_start[sp.k[1]+1];i++)
+		{
+			sm_move(wk,sm_table[i],sp.k[1],-1);
+			l_new += pct_log(n++)+table_loglik(wk,k);
+			sm_move(wk,sm_table[i],k,1,false);
+		}
+		double r = l_new-l[0]-l[1]-log(gamma)+lq;
+		sp.accept = log(wk.rng.drand())<r;
+		for(uint32_t i=sm_start[sp.k[1]];i<sm_start[sp.k[1]+1];i++)
+		{
+			uint64_t x = sm_table[i];
+			if(sp.accept)
+				menu[x>>32][(uint32_t)x] = k;
+			else
+			{
+				sm_move(wk,x,k,-1);
+				sm_move(wk,x,sp.k[1],1,false);
+			}
+		}
+		if(sp.accept)
+		{
+			menu_stat[k] += menu_stat[sp.k[1]];
+			menu_stat[sp.k[1]] = 0;
+		}
+	}
+
+	// Stream of pair sp, after the draws of its anchors
+	void sm_rng(Worker& wk, const SplitPair& sp)
+	{
+		wk.rng.set(seed,&sp-sm_pair.head,(uint32_t)n_sweep,RNG_SPLIT);
+		wk.rng.drand();
+		wk.rng.drand();
+	}
+
+	// Docs before first are known to have no empty table
+	void remove_empty(uint32_t first=0)
+	{
+		remove_empty_tables(first);
+		Vec<uint32_t> src;
+		uint32_t len = menu_src(src);
+		if(len<src.len)
+			compact_menus(src,len);
+	}
+
+	void remove_empty_tables(uint32_t first=0)
+	{
+		for(uint32_t d=first;d<n_doc;d++)
 		{
 			for(int t=table_stat[d].len-1;t>=0;t--)
 			{
@@ -336,58 +1948,83 @@ public:
 				menu_stat_sum--;
 				// Move last table to table t
 				uint32_t last = table_stat[d].len-1;
-				for(uint32_t i=0;i<dat[d].len;i++)
-					if(table[d][i]==last)
-						table[d][i]=t;
+				DocState::Tokens x = st.tokens(d);
+				for(uint32_t i=table_head[d][last];i!=NIL;i=x.next(i))
+					x.set_table(i,t);
+				table_head[d][t] = table_head[d][last];
 				table_stat[d][t] = table_stat[d][last];
-				table_stat[d].len--;
 				menu[d][t] = menu[d][last];
-				menu[d].len--;
+				st.tab[d].len--;
 			}
 		}
-		// Remove empty menu
-		for(int k=menu_stat.len-1;k>=0;k--)
+	}
+
+	// Keep menus src[0],...,src[len-1] as 0,...,len-1, in the model
+	// and the tables
+	void compact_menus(const Vec<uint32_t>& src, uint32_t len)
+	{
+		Vec<uint32_t> remap(src.len>0?src.len:1);
+		remap.resize(src.len);
+		for(uint32_t j=0;j<len;j++)
+			remap[src[j]] = j;
+		for(uint32_t d=0;d<n_doc;d++)
 		{
-			if(menu_stat[k]>0)
-				continue;
-			// Move last menu to menu k
-			uint32_t last = menu_stat.len-1;
-			for(uint32_t d=0;d<n_doc;d++)
-				for(uint32_t t=0;t<menu[d].len;t++)
-					if(menu[d][t]==last) // more efficient?
-						menu[d][t]=k;
-			menu_stat[k] = menu_stat[last];
-			menu_stat.len--;
-			word_stat_sum[k] = word_stat_sum[last];
-			word_stat_sum.len--;
-			free(word_stat[k]);
-			word_stat[k] = word_stat[last];
-			word_stat.len--;
+			Span<uint32_t> mn = menu[d];
+			for(uint32_t t=0;t<mn.len;t++)
+				mn[t] = remap[mn[t]];
 		}
+		Model::compact(src,len);
 	}
 
-	void summary(uint32_t verbosity)
+	/**
+	 * Joint log-likelihood of the words and the seating:
+	 * words given menus (Dirichlet-multinomial per menu), tables given
+	 * docs (CRP with alpha) and menus of tables (CRP with gamma).
+	 * O(nonzero word counts + tables).
+	 */
+	double loglik()
 	{
-		if(verbosity>0)
-			printf("#menu: %5u	#table: %8u\n",menu_stat.len,menu_stat_sum);
-		if(verbosity>1)
+		double s = word_loglik(beta);
+		uint32_t n_menu = menu_stat.len;
+		for(uint32_t d=0;d<n_doc;d++)
 		{
-			for(uint32_t k=0;k<menu_stat.len;k++)
-			{
-				printf("menu %3u: ",k);
-				printf("#table: %5u  ",menu_stat[k]);
-				printf("#word: %7u\n",word_stat_sum[k]);
-			}
+			uint32_t n_t = table_stat[d].len;
+			for(uint32_t t=0;t<n_t;t++)
+				s += lgamma(table_stat[d][t]);
+			s += n_t*log(alpha)+lgamma(alpha)-lgamma(dat[d].len+alpha);
 		}
+		for(uint32_t k=0;k<n_menu;k++)
+			s += lgamma(menu_stat[k]);
+		s += n_menu*log(gamma)+lgamma(gamma)-lgamma(menu_stat_sum+gamma);
+		return s;
 	}
 
 	void output_topics(FILE* fo)
 	{
+		uint32_t * cnt;
+		qassert((cnt=(uint32_t*)malloc(n_word*sizeof(uint32_t))));
 		for(uint32_t k=0;k<word_stat.len;k++)
 		{
+			word_stat.get_row(k,cnt);
 			for(uint32_t w=0;w<n_word-1;w++)
-				fprintf(fo,"%u\t",word_stat[k][w]);
-			fprintf(fo,"%u\n",word_stat[k][n_word-1]);
+				fprintf(fo,"%u\t",cnt[w]);
+			fprintf(fo,"%u\n",cnt[n_word-1]);
+		}
+		free(cnt);
+	}
+
+	// Add the words of doc d per menu to cnt (n_menu long), pushing to
+	// id the menus whose count was 0
+	void doc_menus(uint32_t d, Vec<uint32_t>& cnt, Vec<uint32_t>& id)
+	{
+		for(uint32_t t=0;t<table_stat[d].len;t++)
+		{
+			uint32_t k = menu[d][t];
+			if(0==table_stat[d][t])
+				continue;
+			if(0==cnt[k])
+				id.push_back(k);
+			cnt[k] += table_stat[d][t];
 		}
 	}
 
@@ -407,7 +2044,118 @@ public:
 		free(cnt);
 	}
 
-	void check()
+	/**
+	 * Write the sampler state after iteration iter, with the global RNG
+	 * (of doc orders) and the position of the doc streams. The file is first
+	 * written to filename.tmp, then renamed.
+	 */
+	void save(const char* filename, uint32_t iter)
+	{
+		char tmp[4096]; //overflow?
+		snprintf(tmp,sizeof(tmp),"%s.tmp",filename);
+		SnapWriter sw;
+		sw.open(tmp);
+		SnapHead h = {n_doc,n_word,dat.n_token,iter,alpha,beta,gamma,__lcg64_r,seed,n_sweep};
+		h.save(sw);
+		sw.put_vec(table_order);
+		sw.put_vec(menu_order);
+		Model::save(sw);
+		Vec<uint32_t> v[3]; // table, next and prev of the tokens
+		for(uint32_t d=0;d<n_doc;d++)
+		{
+			sw.put_vec(table_stat[d]);
+			sw.put_vec(menu[d]);
+			sw.put_vec(table_head[d]);
+			DocState::Tokens x = st.tokens(d);
+			for(uint32_t j=0;j<3;j++)
+				v[j].resize(x.len);
+			for(uint32_t i=0;i<x.len;i++)
+			{
+				v[0][i] = x.table(i);
+				v[1][i] = x.next(i);
+				v[2][i] = x.prev(i);
+			}
+			for(uint32_t j=0;j<3;j++)
+				sw.put_vec(v[j]);
+		}
+		sw.put((uint32_t)SnapHead::MAGIC);
+		sw.close();
+		if(rename(tmp,filename))
+			error("Cannot rename %s to %s\n",tmp,filename);
+	}
+
+	/**
+	 * Restore the state written by save() in place of init(), return
+	 * the iteration. Hyperparameters, seed and layout are the saved ones.
+	 * If n_saved is given, the snapshot may be of the first *n_saved
+	 * docs only; the others are to be seated by init(*n_saved).
+	 */
+	uint32_t load(const char* filename, uint32_t* n_saved=NULL)
+	{
+		SnapReader sr;
+		sr.open(filename);
+		SnapHead h;
+		h.load(sr);
+		if(h.n_doc>n_doc or (NULL==n_saved and h.n_doc!=n_doc) or h.n_word!=n_word
+				or h.n_token!=dat.offset[h.n_doc])
+			error("%s is for %u docs, %u words, %lu tokens\n",
+					filename,h.n_doc,h.n_word,(unsigned long)h.n_token);
+		if(NULL!=n_saved)
+			*n_saved = h.n_doc;
+		if(h.alpha!=alpha or h.beta!=beta or h.gamma!=gamma)
+			config(h.alpha,h.beta,h.gamma);
+		__lcg64_r = h.rng;
+		seed = h.seed;
+		n_sweep = h.sweep;
+		sr.get_vec(table_order);
+		sr.get_vec(menu_order);
+		if(table_order.len!=h.n_doc or menu_order.len!=h.n_doc)
+			error("%s: bad doc order\n",filename);
+		for(uint32_t d=h.n_doc;d<n_doc;d++)
+		{
+			table_order.push_back(d);
+			menu_order.push_back(d);
+		}
+		Model::load(sr);
+		if(word_stat.n_word!=n_word)
+			error("%s: bad number of words\n",filename);
+		state_init();
+		Vec<uint32_t> v[3]; // table, next and prev of the tokens
+		for(uint32_t d=0;d<h.n_doc;d++)
+		{
+			uint64_t n_t = sr.get_len();
+			uint32_t n_i = dat[d].len;
+			if(n_t>n_i+1)
+				error("%s: bad state of doc %u\n",filename,d);
+			st.reserve(d,n_t);
+			st.tab[d].len = n_t;
+			if(n_t>0)
+				memcpy(table_stat[d].head,sr.get(n_t*sizeof(uint32_t)),n_t*sizeof(uint32_t));
+			sr.get_array(menu[d].head,n_t);
+			sr.get_array(table_head[d].head,n_t);
+			DocState::Tokens x = st.tokens(d);
+			for(uint32_t j=0;j<3;j++)
+			{
+				v[j].resize(n_i);
+				sr.get_array(v[j].head,n_i);
+			}
+			for(uint32_t i=0;i<n_i;i++)
+			{
+				if(v[0][i]>=n_t or (v[1][i]>=n_i and v[1][i]!=NIL) or (v[2][i]>=n_i and v[2][i]!=NIL))
+					error("%s: bad state of doc %u\n",filename,d);
+				x.set_table(i,v[0][i]);
+				x.set_next(i,v[1][i]);
+				x.set_prev(i,v[2][i]);
+			}
+		}
+		if(SnapHead::MAGIC!=sr.get<uint32_t>())
+			error("%s: bad end of snapshot\n",filename);
+		return h.iter;
+	}
+
+	// Abort in qassert if the counts do not match the seating, print
+	// each passed step if verbose
+	void check(bool verbose=true)
 	{
 		uint32_t * tmp;
 		// Check num of menu
@@ -416,13 +2164,14 @@ public:
 		// Check num of table
 		for(uint32_t d=0;d<n_doc;d++)
 			qassert(menu[d].len==table_stat[d].len);	
-		debug("[PASS] N menu, N table\n");
+		if(verbose)
+			debug("[PASS] N menu, N table\n");
 		// Check word_stat_sum
 		for(uint32_t k=0;k<word_stat.len;k++)
 		{
 			uint32_t s = 0;
 			for(uint32_t w=0;w<n_word;w++)
-				s += word_stat[k][w];
+				s += word_stat.get(k,w);
 			qassert(word_stat_sum[k]==s);
 		}
 		for(uint32_t k=0;k<word_stat.len;k++)
@@ -433,7 +2182,8 @@ public:
 					s += (menu[d][t]==k?table_stat[d][t]:0);
 			qassert(s==word_stat_sum[k]);
 		}
-		debug("[PASS] word_stat_sum\n");
+		if(verbose)
+			debug("[PASS] word_stat_sum\n");
 		// Check menu_stat_sum
 		uint32_t s=0;
 		for(uint32_t k=0;k<menu_stat.len;k++)
@@ -444,13 +2194,36 @@ public:
 		{
 			tmp = (uint32_t*)malloc(table_stat[d].len*sizeof(uint32_t));
 			memset(tmp,0,table_stat[d].len*sizeof(uint32_t));
-			for(uint32_t i=0;i<dat[d].len;i++)
-				tmp[table[d][i]]++; //=dat[d][i].n;
+			DocState::Tokens x = st.tokens(d);
+			for(uint32_t i=0;i<x.len;i++)
+			{
+				qassert(x.word(i)==dat[d][i]);
+				tmp[x.table(i)]++; //=dat[d][i].n;
+			}
 			for(uint32_t t=0;t<table_stat[d].len;t++)
 				qassert(tmp[t]==table_stat[d][t]);
 			free(tmp);
 		}
-		debug("[PASS] table_stat\n");
+		if(verbose)
+			debug("[PASS] table_stat\n");
+		// Check lists of words at tables
+		for(uint32_t d=0;d<n_doc;d++)
+		{
+			qassert(table_head[d].len==table_stat[d].len);
+			DocState::Tokens x = st.tokens(d);
+			for(uint32_t t=0;t<table_stat[d].len;t++)
+			{
+				uint32_t n = 0;
+				for(uint32_t i=table_head[d][t];i!=NIL;i=x.next(i),n++)
+				{
+					qassert(x.table(i)==t);
+					qassert(x.next(i)==NIL or x.prev(x.next(i))==i);
+				}
+				qassert(n==table_stat[d][t]);
+			}
+		}
+		if(verbose)
+			debug("[PASS] table_head\n");
 		// Check menu_stat
 		tmp = (uint32_t*)malloc(menu_stat.len*sizeof(uint32_t));
 		memset(tmp,0,menu_stat.len*sizeof(uint32_t));
@@ -459,21 +2232,26 @@ public:
 				tmp[menu[d][t]]++;
 		for(uint32_t k=0;k<menu_stat.len;k++)
 			qassert(tmp[k]==menu_stat[k]);
-		debug("[PASS] menu_stat\n");
+		if(verbose)
+			debug("[PASS] menu_stat\n");
 		// Check word_stat
 		tmp = (uint32_t*)malloc(word_stat.len*n_word*sizeof(uint32_t));
 		memset(tmp,0,word_stat.len*n_word*sizeof(uint32_t));
 		for(uint32_t d=0;d<n_doc;d++)
-			for(uint32_t i=0;i<dat[d].len;i++)
+		{
+			DocState::Tokens x = st.tokens(d);
+			for(uint32_t i=0;i<x.len;i++)
 			{
-				uint32_t k=menu[d][table[d][i]];
-				tmp[k*n_word+dat[d][i]]++; //=dat[d][i].n;
+				uint32_t k=menu[d][x.table(i)];
+				tmp[k*n_word+x.word(i)]++; //=dat[d][i].n;
 			}
+		}
 		for(uint32_t k=0;k<word_stat.len;k++)
 			for(uint32_t w=0;w<n_word;w++)
-				qassert(tmp[k*n_word+w]==word_stat[k][w]);
+				qassert(tmp[k*n_word+w]==word_stat.get(k,w));
 		free(tmp);
-		debug("[PASS] word_stat\n");
+		if(verbose)
+			debug("[PASS] word_stat\n");
 	}
 
 };
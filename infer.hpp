@@ -0,0 +1,428 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <pthread.h>
+#include "vec.hpp"
+#include "rng.hpp"
+#include "corpus.hpp"
+#include "snapshot.hpp"
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * Fold-in inference of topic proportions of new documents with a
+ * trained model, which is never changed.
+ *
+ * Each doc runs the CRF sampler on its own tables only: words are
+ * reassigned among tables (reassign_user) and tables among the K
+ * trained menus (reassign_table). The model counts do not include the
+ * doc, and no menu is added. After burn-in, the proportions
+ *   theta[k] = (n_dk + alpha*m_k/M) / (n_d + alpha)
+ * are averaged over sweeps. Words unknown to the model are skipped.
+ */
+class Infer
+{
+public:
+	Model own; // of load()
+	const Model* m; // read-only: own, or the model of set_model()
+	uint32_t n_word;
+	double alpha;
+	double beta;
+	double gamma;
+
+	Vec<double> pi; // m_k/M
+	Vec<double> inv_den; // 1/(n_k+V*beta)
+
+	uint32_t n_iter; // sweeps per doc
+	uint32_t burnin;
+	uint64_t seed;
+	uint32_t n_thread;
+
+	/**
+	 * Sampling state of one doc (reused across docs by a thread)
+	 */
+	struct State
+	{
+		Vec<uint32_t> uw; // unique word of token i
+		Vec<uint32_t> word; // unique words
+		Vec<double> f; // f[u*K+k] = p(word[u] | menu k)
+		Vec<double> lf; // log of f
+		Vec<double> g; // g[u] = sum_k pi[k]*f[u*K+k]
+		Vec<uint32_t> table; // table of token i
+		Vec<uint32_t> table_stat;
+		Vec<uint32_t> menu;
+		Vec<double> p;
+		Vec<double> cum;
+		Vec<double> theta;
+		Vec<uint32_t> slot; // index into word of a word id, ~0u if none
+		Vec<double> th; // proportions of completion()
+		Vec<uint32_t> obs; // observed words of completion()
+		Vec<uint32_t> held; // and the held-out ones
+		Rng rs; // stream of the current doc
+	};
+
+	// Shared by the threads of run()
+	struct Job
+	{
+		Infer* in;
+		const Corpus* c;
+		double* theta; // of run()
+		double* ll; // of completion(), log-likelihood of doc d
+		uint32_t* n_eval; // and its number of words
+		volatile uint32_t next; // next doc to take
+		uint32_t n_doc;
+	};
+
+	// Stream (d,0,kind) of seed for doc d
+	enum RngKind { RNG_SAMPLE, RNG_SPLIT };
+
+	Infer(): m(NULL), n_word(0), alpha(1), beta(0.5), gamma(1),
+		n_iter(20), burnin(10), seed(0), n_thread(1) {}
+
+	// Read the model from a snapshot of HDP::save()
+	void load(const char* filename)
+	{
+		SnapReader sr;
+		sr.open(filename);
+		SnapHead h;
+		h.load(sr);
+		n_word = h.n_word;
+		alpha = h.alpha;
+		beta = h.beta;
+		gamma = h.gamma;
+		Vec<uint32_t> order;
+		sr.get_vec(order); // table_order
+		sr.get_vec(order); // menu_order
+		own.load(sr);
+		m = &own;
+		if(own.word_stat.n_word!=n_word or 0==own.menu_stat.len)
+			error("%s: bad model\n",filename);
+		prepare_model();
+	}
+
+	// Use model src (of an HDP or Direct being trained), with alpha, beta
+	// and gamma as set. src is not copied: it must not change until the
+	// next set_model().
+	void set_model(const Model& src)
+	{
+		m = &src;
+		n_word = m->word_stat.n_word;
+		prepare_model();
+	}
+
+	void prepare_model()
+	{
+		uint32_t K = m->menu_stat.len;
+		pi.resize(K);
+		inv_den.resize(K);
+		for(uint32_t k=0;k<K;k++)
+		{
+			pi[k] = (double)m->menu_stat[k]/m->menu_stat_sum;
+			inv_den[k] = 1/(m->word_stat_sum[k]+n_word*beta);
+		}
+	}
+
+	uint32_t n_menu() { return m->menu_stat.len; }
+
+	/**
+	 * Topic proportions of all docs of c (which may use word ids
+	 * unknown to the model), theta[d*K+k].
+	 */
+	void run(const Corpus& c, double* theta)
+	{
+		Job job = {this,&c,theta,NULL,NULL,0,c.n_doc};
+		start(job);
+	}
+
+	/**
+	 * Perplexity of c by document completion: each word of a doc is held
+	 * out with probability 1/2 (from stream (d,0,RNG_SPLIT), so the split
+	 * is the same in every call), the proportions are inferred from the
+	 * others, then the held-out words scored with
+	 * sum_k theta[k]*p(w | menu k). 0 if no word is scored.
+	 */
+	double completion(const Corpus& c)
+	{
+		uint32_t n = c.n_doc>0?c.n_doc:1;
+		Vec<double> ll(n);
+		Vec<uint32_t> n_eval(n);
+		ll.resize(c.n_doc);
+		n_eval.resize(c.n_doc);
+		Job job = {this,&c,NULL,ll.head,n_eval.head,0,c.n_doc};
+		start(job);
+		double s = 0;
+		uint64_t n_tok = 0;
+		for(uint32_t d=0;d<c.n_doc;d++) // in order, same sum for any thread
+		{
+			s += ll[d];
+			n_tok += n_eval[d];
+		}
+		return n_tok>0?exp(-s/n_tok):0;
+	}
+
+private:
+	void start(Job& job)
+	{
+		uint32_t n = n_thread>0?n_thread:1;
+		if(1==n)
+		{
+			run_thread(&job);
+			return;
+		}
+		pthread_t* th = (pthread_t*)malloc(n*sizeof(pthread_t));
+		for(uint32_t j=0;j<n;j++)
+			if(pthread_create(&th[j],NULL,run_thread,&job))
+				error("Cannot create thread %u.\n",j);
+		for(uint32_t j=0;j<n;j++)
+			pthread_join(th[j],NULL);
+		free(th);
+	}
+
+	static void* run_thread(void* arg)
+	{
+		Job& job = *(Job*)arg;
+		State x;
+		x.slot.resize(job.in->n_word);
+		memset(&(x.slot[0]),0xff,job.in->n_word*sizeof(uint32_t));
+		uint32_t K = job.in->n_menu();
+		// Docs are short: take a few at a time
+		for(;;)
+		{
+			uint32_t begin = __sync_fetch_and_add(&job.next,16);
+			if(begin>=job.n_doc)
+				break;
+			uint32_t end = begin+16<job.n_doc?begin+16:job.n_doc;
+			for(uint32_t d=begin;d<end;d++)
+			{
+				if(NULL!=job.theta)
+				{
+					x.rs.set(job.in->seed,d,0,RNG_SAMPLE);
+					job.in->infer_doc(x,(*job.c)[d],job.theta+(uint64_t)d*K);
+				}
+				else
+					job.in->complete_doc(x,d,(*job.c)[d],job.ll+d,job.n_eval+d);
+			}
+		}
+		x.slot.dtor();
+		return NULL;
+	}
+
+public:
+	// Proportions of a doc (same for any thread, given seed)
+	void infer_doc(State& x, Doc doc, double* theta)
+	{
+		uint32_t K = n_menu();
+		prepare(x,doc);
+		uint32_t n = x.uw.len;
+		x.table.clear();
+		x.table_stat.clear();
+		x.menu.clear();
+		x.theta.resize(K);
+		memset(&(x.theta[0]),0,K*sizeof(double));
+		for(uint32_t i=0;i<n;i++)
+		{
+			x.table.push_back(~0u);
+			reassign_user(x,i);
+		}
+		uint32_t n_sample = 0;
+		for(uint32_t it=0;it<n_iter;it++)
+		{
+			for(uint32_t i=0;i<n;i++)
+				reassign_user(x,i);
+			for(uint32_t t=0;t<x.table_stat.len;t++)
+				reassign_table(x,t);
+			if(it<burnin and it+1<n_iter)
+				continue;
+			for(uint32_t t=0;t<x.table_stat.len;t++)
+				x.theta[x.menu[t]] += x.table_stat[t];
+			n_sample++;
+		}
+		for(uint32_t k=0;k<K;k++)
+			theta[k] = (x.theta[k]/(n_sample>0?n_sample:1)+alpha*pi[k])/(n+alpha);
+	}
+
+private:
+	// Log-likelihood of the held-out words of doc d given the others
+	void complete_doc(State& x, uint32_t d, Doc doc, double* ll, uint32_t* n_eval)
+	{
+		uint32_t K = n_menu();
+		x.obs.clear();
+		x.held.clear();
+		x.rs.set(seed,d,0,RNG_SPLIT);
+		for(uint32_t i=0;i<doc.len;i++)
+		{
+			if(x.rs.drand()<0.5)
+				x.held.push_back(doc[i]);
+			else
+				x.obs.push_back(doc[i]);
+		}
+		Doc seen = {x.obs.head,x.obs.len};
+		x.th.resize(K);
+		x.rs.set(seed,d,0,RNG_SAMPLE);
+		infer_doc(x,seen,&(x.th[0]));
+		*ll = 0;
+		*n_eval = 0;
+		for(uint32_t i=0;i<x.held.len;i++)
+		{
+			uint32_t w = x.held[i];
+			if(w>=n_word)
+				continue;
+			double p = 0;
+			for(uint32_t k=0;k<K;k++)
+				p += x.th[k]*(m->word_stat.get(k,w)+beta)*inv_den[k];
+			*ll += log(p);
+			(*n_eval)++;
+		}
+	}
+
+	// Unique words of doc and their likelihoods under each menu
+	void prepare(State& x, Doc doc)
+	{
+		uint32_t K = n_menu();
+		x.uw.clear();
+		x.word.clear();
+		for(uint32_t i=0;i<doc.len;i++)
+		{
+			uint32_t w = doc[i];
+			if(w>=n_word)
+				continue;
+			if(~0u==x.slot[w])
+			{
+				x.slot[w] = x.word.len;
+				x.word.push_back(w);
+			}
+			x.uw.push_back(x.slot[w]);
+		}
+		uint32_t U = x.word.len;
+		x.f.resize(U*K+1);
+		x.lf.resize(U*K+1);
+		x.g.resize(U+1);
+		for(uint32_t u=0;u<U;u++)
+		{
+			uint32_t w = x.word[u];
+			double* f = &(x.f[u*K]);
+			double* lf = &(x.lf[u*K]);
+			double g = 0;
+			for(uint32_t k=0;k<K;k++)
+			{
+				f[k] = (m->word_stat.get(k,w)+beta)*inv_den[k];
+				lf[k] = log(f[k]);
+				g += pi[k]*f[k];
+			}
+			x.g[u] = g;
+			x.slot[w] = ~0u; // slot is clean for the next doc
+		}
+	}
+
+	void add_table(State& x, uint32_t k)
+	{
+		x.table_stat.push_back(0);
+		x.menu.push_back(k);
+	}
+
+	// Remove empty table t by moving the last table to t
+	void remove_table(State& x, uint32_t t)
+	{
+		uint32_t last = x.table_stat.len-1;
+		if(t!=last)
+		{
+			for(uint32_t i=0;i<x.table.len;i++)
+				if(x.table[i]==last)
+					x.table[i] = t;
+			x.table_stat[t] = x.table_stat[last];
+			x.menu[t] = x.menu[last];
+		}
+		x.table_stat.len--;
+		x.menu.len--;
+	}
+
+	void reassign_user(State& x, uint32_t i)
+	{
+		uint32_t K = n_menu();
+		uint32_t u = x.uw[i];
+		uint32_t t_old = x.table[i];
+		if(t_old!=~0u and 0==--x.table_stat[t_old])
+			remove_table(x,t_old);
+		// Existing tables, then a new one
+		uint32_t T = x.table_stat.len;
+		const double* f = &(x.f[u*K]);
+		x.p.resize(T+1);
+		x.cum.resize(T+1);
+		for(uint32_t t=0;t<T;t++)
+			x.p[t] = x.table_stat[t]*f[x.menu[t]];
+		x.p[T] = alpha*x.g[u];
+		uint32_t t = rmultinorm_r(&x.rs,&(x.p[0]),&(x.cum[0]),T+1);
+		if(t==T)
+		{
+			x.p.resize(K);
+			x.cum.resize(K);
+			for(uint32_t k=0;k<K;k++)
+				x.p[k] = pi[k]*f[k];
+			add_table(x,rmultinorm_r(&x.rs,&(x.p[0]),&(x.cum[0]),K));
+		}
+		x.table[i] = t;
+		x.table_stat[t]++;
+	}
+
+	void reassign_table(State& x, uint32_t t)
+	{
+		uint32_t K = n_menu();
+		x.p.resize(K);
+		x.cum.resize(K);
+		for(uint32_t k=0;k<K;k++)
+			x.p[k] = log(pi[k]);
+		for(uint32_t i=0;i<x.table.len;i++)
+			if(x.table[i]==t)
+			{
+				const double* lf = &(x.lf[x.uw[i]*K]);
+				for(uint32_t k=0;k<K;k++)
+					x.p[k] += lf[k];
+			}
+		double mx = x.p[0];
+		for(uint32_t k=1;k<K;k++)
+			mx = x.p[k]>mx?x.p[k]:mx;
+		for(uint32_t k=0;k<K;k++)
+			x.p[k] = exp(x.p[k]-mx);
+		x.menu[t] = rmultinorm_r(&x.rs,&(x.p[0]),&(x.cum[0]),K);
+	}
+};
+
+/**
+ * Held-out perplexity of the model being trained, every `every`
+ * iterations, for early stopping: the run is over once `patience`
+ * evaluations in a row did not improve on the best by a fraction
+ * `tolerance` of it.
+ */
+class Heldout
+{
+public:
+	Corpus c;
+	Infer inf;
+	uint32_t every;
+	uint32_t patience; // 0: never stop
+	double tolerance;
+	double best; // 0 before the first evaluation
+	uint32_t n_bad; // evaluations since the best
+
+	Heldout(): every(10), patience(3), tolerance(1e-3), best(0), n_bad(0) {}
+
+	// Perplexity of m (of an HDP or Direct) by document completion
+	double eval(Model& m)
+	{
+		inf.set_model(m);
+		double x = inf.completion(c);
+		if(0==best or x<best*(1-tolerance))
+		{
+			best = x;
+			n_bad = 0;
+		}
+		else
+			n_bad++;
+		return x;
+	}
+
+	bool stop() { return patience>0 and n_bad>=patience; }
+};
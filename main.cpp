@@ -1,8 +1,61 @@
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 #include "rng.hpp"
 #include "hdp.hpp"
+#include "corpus.hpp"
+#include "output.hpp"
+#include "infer.hpp"
+#include "metrics.hpp"
 #include "pct.hpp"
+#include "dist.hpp"
+#include "direct.hpp"
+
+// Empty tables and menus removed, by the server with dw
+void remove_empty(HDP& hdp, uint32_t first, Metrics& mt, DistWorker* dw)
+{
+	mt.start();
+	if(NULL==dw)
+	{
+		hdp.remove_empty(first);
+		mt.stop(Metrics::EMPTY);
+		return;
+	}
+	hdp.remove_empty_tables(first);
+	mt.stop(Metrics::EMPTY);
+	mt.start();
+	dw->sync(hdp);
+	mt.stop(Metrics::SYNC);
+}
+
+// Held-out perplexity of m at iteration i if due, true if the run is over
+bool heldout_stop(Heldout& ho, Model& m, uint32_t i, Metrics& mt, uint32_t verbosity)
+{
+	if(0==ho.c.n_doc or i%ho.every!=0)
+		return false;
+	mt.start();
+	mt.perplexity = ho.eval(m);
+	mt.stop(Metrics::HELDOUT);
+	if(verbosity>0)
+		fprintf(stderr,"held-out perplexity: %.2f (best %.2f)\n",mt.perplexity,ho.best);
+	if(ho.stop() and verbosity>0)
+		fprintf(stderr,"No gain in %u evaluations, stopping at iteration %u\n",ho.n_bad,i);
+	return ho.stop();
+}
+
+// One sweep over docs first,...,n_doc-1
+void sweep(HDP& hdp, uint32_t first, Metrics& mt, DistWorker* dw)
+{
+	mt.start();
+	hdp.gibbs_table(first);
+	mt.stop(Metrics::TABLE);
+	mt.n_token += hdp.dat.n_token-hdp.dat.offset[first];
+	remove_empty(hdp,first,mt,dw);
+	mt.start();
+	hdp.gibbs_menu(first);
+	mt.stop(Metrics::MENU);
+	remove_empty(hdp,first,mt,dw);
+}
 
 int main(int argc, char* argv[])
 {
@@ -10,21 +63,86 @@ int main(int argc, char* argv[])
 	double alpha=1, beta=0.5, gamma=1;
 	char * dat = NULL;
 	char * outdir = (char*)"./";
+	char * out = NULL; // for convert and infer
 	uint32_t max_iter = 100, out_iter = 0;
 	uint32_t seed = 0, verbosity = 1;
+	uint32_t n_thread = 1;
+	WordStat::Layout layout = WordStat::DENSE;
+	HDP::Sampler sampler = HDP::SAMPLER_PLAIN;
+	uint32_t mh_steps = 4;
+	bool direct = false; // engine
+	uint32_t split_every = 0, split_pairs = 16;
+	HDP::MenuCommit menu_commit = HDP::MENU_EXACT;
+	uint32_t checkpoint_every = 0;
+	char * resume = NULL;
+	char * append = NULL;
+	uint32_t new_sweeps = 1, old_every = 10;
+	Metrics mt;
+	uint32_t loglik_every = 1;
+	Output out_writer;
+	Infer inf;
+	char * model = NULL;
+	char * heldout = NULL;
+	Heldout ho;
+	char * listen = NULL; // for server
+	char * server = NULL;
+	uint32_t rank = 0, n_rank = 1;
 
+	// Subcommands "convert": lda-c to binary corpus,
+	// "infer": topic proportions of docs with a trained model,
+	// "server": model of workers started with -server
+	bool convert = (argc>1 and 0==strcmp(argv[1],"convert"));
+	bool infer = (argc>1 and 0==strcmp(argv[1],"infer"));
+	bool serve = (argc>1 and 0==strcmp(argv[1],"server"));
+	if(convert or infer or serve)
+	{
+		argc--;
+		argv++;
+	}
 	if(1==argc) {
 		fprintf(stderr," Usage: %s [OPTIONS]\n",argv[0]);
-		fprintf(stderr,"	-data		Datafile in lda-c format\n");
-		fprintf(stderr,"	-ndoc		Number of doc in data\n");
-		fprintf(stderr,"	-nword		Number of vocabulary in data\n");
+		fprintf(stderr,"        %s convert -data FILE -out FILE\n",argv[0]);
+		fprintf(stderr,"        %s infer -model FILE -data FILE -out FILE\n",argv[0]);
+		fprintf(stderr,"        %s server -listen ADDR -workers N [-layout L]\n",argv[0]);
+		fprintf(stderr,"	-data		Datafile in lda-c or binary format\n");
+		fprintf(stderr,"	-ndoc		Number of doc to use (all in data)\n");
+		fprintf(stderr,"	-nword		Number of vocabulary (max word id in data + 1)\n");
+		fprintf(stderr,"	-out		Binary corpus written by convert, proportions by infer\n");
+		fprintf(stderr,"	-model		Checkpoint to infer with\n");
+		fprintf(stderr,"	-infer_iter	Sweeps per doc of infer (20)\n");
+		fprintf(stderr,"	-burnin		Sweeps of infer before averaging (10)\n");
 		fprintf(stderr,"	-outdir		Directory for output (./)\n");
 		fprintf(stderr,"	-alpha		2nd-level effective sample size in HDP (1.0)\n");
 		fprintf(stderr,"	-beta		Prior for Dirichlet dist on words (0.5)\n");
 		fprintf(stderr,"	-gamma		1st-level effective sample size in HDP (1.0)\n");
 		fprintf(stderr,"	-max_iter	Max iteration for CRF procedure (100)\n");
 		fprintf(stderr,"	-out_iter	Output iteration for CRF procedure (max_iter)\n");
+		fprintf(stderr,"	-out_format	Output of topics and assignments: dense, sparse or binary (dense)\n");
+		fprintf(stderr,"	-top_n		Output top N words of each topic, sparse/binary only (0: all)\n");
 		fprintf(stderr,"	-seed		Random seed (0)\n");
+		fprintf(stderr,"	-threads	Number of threads for table and menu sampling (1)\n");
+		fprintf(stderr,"	-engine		crf (tables) or direct (a menu per word, one thread) (crf)\n");
+		fprintf(stderr,"	-sampler	Sampler of crf: plain, bucket or alias (plain)\n");
+		fprintf(stderr,"	-mh_steps	Metropolis-Hastings steps of alias sampler (4)\n");
+		fprintf(stderr,"	-menu_commit	Menu sampling with threads: exact or delayed (exact)\n");
+		fprintf(stderr,"	-split_merge	Split-merge moves over menus every N iterations (0: never)\n");
+		fprintf(stderr,"	-split_pairs	Split-merge proposals per round (16)\n");
+		fprintf(stderr,"	-layout		Storage of topic-word counts: dense, sparse or word (dense)\n");
+		fprintf(stderr,"	-checkpoint_every	Write outdir/checkpoint.bin every N iterations (0: never)\n");
+		fprintf(stderr,"	-resume		Continue from a checkpoint\n");
+		fprintf(stderr,"	-append		New docs to add to the resumed data (iterations count from 1)\n");
+		fprintf(stderr,"	-new_sweeps	Sweeps over the new docs per iteration with -append (1)\n");
+		fprintf(stderr,"	-old_every	With -append, sweep over all docs every N iterations (10, 0: never)\n");
+		fprintf(stderr,"	-listen		Address of server: unix:PATH or [HOST]:PORT\n");
+		fprintf(stderr,"	-server		Address of the server to train with, docs split among workers\n");
+		fprintf(stderr,"	-workers	Number of workers of the server (1)\n");
+		fprintf(stderr,"	-rank		Worker number, 0 to workers-1 (0)\n");
+		fprintf(stderr,"	-heldout	Docs to compute perplexity on (document completion) for early stopping\n");
+		fprintf(stderr,"	-heldout_every	Held-out perplexity every N iterations (10)\n");
+		fprintf(stderr,"	-patience	Stop after N held-out evaluations without gain (3, 0: never)\n");
+		fprintf(stderr,"	-tolerance	Smallest relative gain of perplexity (0.001)\n");
+		fprintf(stderr,"	-metrics	Write per-iteration metrics as JSON lines to a file\n");
+		fprintf(stderr,"	-loglik_every	Log-likelihood in metrics every N iterations (1, 0: never)\n");
 		fprintf(stderr,"	-verbosity	Verbosity ranges from 0 to 2. (1)\n");
 		return 0;
 	} else if(0==(argc%2)) {
@@ -35,6 +153,8 @@ int main(int argc, char* argv[])
 	{
 		if(0==strcmp(argv[i],"-data"))
 			dat = argv[++i];
+		else if(0==strcmp(argv[i],"-out"))
+			out = argv[++i];
 		else if(0==strcmp(argv[i],"-outdir"))
 			outdir = argv[++i];
 		else if(0==strcmp(argv[i],"-ndoc"))
@@ -51,8 +171,110 @@ int main(int argc, char* argv[])
 			max_iter = strtol(argv[++i],NULL,10);
 		else if(0==strcmp(argv[i],"-out_iter"))
 			out_iter = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-out_format"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"dense"))
+				out_writer.format = Output::DENSE;
+			else if(0==strcmp(argv[i],"sparse"))
+				out_writer.format = Output::SPARSE;
+			else if(0==strcmp(argv[i],"binary"))
+				out_writer.format = Output::BINARY;
+			else
+				error("Unknown output format %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-top_n"))
+			out_writer.top_n = strtol(argv[++i],NULL,10);
 		else if(0==strcmp(argv[i],"-seed"))
 			seed = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-threads"))
+			n_thread = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-sampler"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"plain"))
+				sampler = HDP::SAMPLER_PLAIN;
+			else if(0==strcmp(argv[i],"bucket"))
+				sampler = HDP::SAMPLER_BUCKET;
+			else if(0==strcmp(argv[i],"alias"))
+				sampler = HDP::SAMPLER_ALIAS;
+			else
+				error("Unknown sampler %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-engine"))
+		{
+			i++;
+			if(0==strcmp(argv[i],"crf"))
+				direct = false;
+			else if(0==strcmp(argv[i],"direct"))
+				direct = true;
+			else
+				error("Unknown engine %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-mh_steps"))
+			mh_steps = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-menu_commit"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"exact"))
+				menu_commit = HDP::MENU_EXACT;
+			else if(0==strcmp(argv[i],"delayed"))
+				menu_commit = HDP::MENU_DELAYED;
+			else
+				error("Unknown menu commit %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-split_merge"))
+			split_every = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-split_pairs"))
+			split_pairs = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-layout"))
+		{
+			++i;
+			if(0==strcmp(argv[i],"dense"))
+				layout = WordStat::DENSE;
+			else if(0==strcmp(argv[i],"sparse"))
+				layout = WordStat::SPARSE;
+			else if(0==strcmp(argv[i],"word"))
+				layout = WordStat::WORD;
+			else
+				error("Unknown layout %s\n",argv[i]);
+		}
+		else if(0==strcmp(argv[i],"-checkpoint_every"))
+			checkpoint_every = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-resume"))
+			resume = argv[++i];
+		else if(0==strcmp(argv[i],"-append"))
+			append = argv[++i];
+		else if(0==strcmp(argv[i],"-new_sweeps"))
+			new_sweeps = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-old_every"))
+			old_every = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-model"))
+			model = argv[++i];
+		else if(0==strcmp(argv[i],"-infer_iter"))
+			inf.n_iter = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-burnin"))
+			inf.burnin = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-listen"))
+			listen = argv[++i];
+		else if(0==strcmp(argv[i],"-server"))
+			server = argv[++i];
+		else if(0==strcmp(argv[i],"-workers"))
+			n_rank = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-rank"))
+			rank = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-heldout"))
+			heldout = argv[++i];
+		else if(0==strcmp(argv[i],"-heldout_every"))
+			ho.every = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-patience"))
+			ho.patience = strtol(argv[++i],NULL,10);
+		else if(0==strcmp(argv[i],"-tolerance"))
+			ho.tolerance = strtod(argv[++i],NULL);
+		else if(0==strcmp(argv[i],"-metrics"))
+			mt.open(argv[++i]);
+		else if(0==strcmp(argv[i],"-loglik_every"))
+			loglik_every = strtol(argv[++i],NULL,10);
 		else if(0==strcmp(argv[i],"-verbosity"))
 			verbosity = strtol(argv[++i],NULL,10);
 		else
@@ -60,40 +282,223 @@ int main(int argc, char* argv[])
 	}
 	if(out_iter==0)
 		out_iter = max_iter;
+	if(serve)
+	{
+		if(NULL==listen or 0==n_rank)
+			error("No address or workers given\n");
+		ParamServer ps;
+		ps.verbosity = verbosity;
+		ps.run(listen,n_rank,layout);
+		return 0;
+	}
+	if(NULL==dat)
+		error("No datafile given\n");
+	if(out_writer.top_n>0 and out_writer.format==Output::DENSE)
+		error("-top_n needs sparse or binary output\n");
 
-	HDP hdp(Ndoc,Nword); //#{doc}, #{vocab}
-	hdp.read_data(dat);
-	hdp.config(alpha,beta,gamma);
+	if(convert)
+	{
+		if(NULL==out)
+			error("No output file given\n");
+		Corpus c;
+		c.read_text(dat,Ndoc,Nword,n_thread);
+		c.write_binary(out);
+		if(verbosity>0)
+			fprintf(stderr,"%u docs, %u words, %lu tokens written to %s\n",
+					c.n_doc,c.n_word,(unsigned long)c.n_token,out);
+		return 0;
+	}
+	if(infer)
+	{
+		if(NULL==model or NULL==out)
+			error("No model or output file given\n");
+		inf.load(model);
+		inf.seed = seed;
+		inf.n_thread = n_thread;
+		Corpus c; // unknown words are skipped
+		c.load(dat,Ndoc,0,n_thread);
+		uint32_t K = inf.n_menu();
+		double* theta;
+		qassert((theta=(double*)malloc(((uint64_t)c.n_doc*K+1)*sizeof(double))));
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		inf.run(c,theta);
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		FILE* f = fopen(out,"w");
+		if(!f)
+			error("Cannot open %s for writing.\n",out);
+		for(uint32_t d=0;d<c.n_doc;d++)
+			for(uint32_t k=0;k<K;k++)
+				fprintf(f,"%.6g%c",theta[(uint64_t)d*K+k],(k+1<K)?'\t':'\n');
+		qassert(0==fclose(f));
+		free(theta);
+		if(verbosity>0)
+		{
+			double sec = (t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)*1e-9;
+			fprintf(stderr,"%u docs, %u menus, %.3lf s, %.0lf docs/s\n",
+					c.n_doc,K,sec,c.n_doc/sec);
+		}
+		return 0;
+	}
+
+	if(NULL!=append and NULL==resume)
+		error("-append needs -resume\n");
+	if(NULL!=server and (NULL!=resume or checkpoint_every>0))
+		error("-server cannot be used with -resume or -checkpoint_every\n");
+	if(direct and (NULL!=resume or NULL!=server or checkpoint_every>0 or split_every>0))
+		error("-engine direct cannot be used with -resume, -server, -checkpoint_every or -split_merge\n");
+	if(NULL!=server and split_every>0)
+		error("-split_merge cannot be used with -server\n");
+	if(NULL!=server and rank>=n_rank)
+		error("Rank %u of %u workers\n",rank,n_rank);
+	Corpus corpus; // #{doc} and #{vocab} found if not given
+	corpus.load(dat,Ndoc,Nword,n_thread);
+	uint32_t doc_base = 0; // of the shard of this worker
+	if(NULL!=server)
+	{
+		doc_base = DistWorker::shard(corpus.n_doc,rank,n_rank);
+		corpus.keep(doc_base,DistWorker::shard(corpus.n_doc,rank+1,n_rank));
+	}
+	if(NULL!=heldout)
+	{
+		if(0==ho.every)
+			error("-heldout_every must be positive\n");
+		ho.c.load(heldout,0,0,n_thread); // unknown words are skipped
+		ho.inf.alpha = alpha;
+		ho.inf.beta = beta;
+		ho.inf.gamma = gamma;
+		ho.inf.n_iter = inf.n_iter;
+		ho.inf.burnin = inf.burnin;
+		ho.inf.seed = seed;
+		ho.inf.n_thread = n_thread;
+	}
+	uint32_t first = 0; // docs before it are old with -append
+	if(NULL!=append)
+	{
+		Corpus c;
+		c.load(append,0,0,n_thread);
+		if(c.n_word>corpus.n_word)
+			error("%s has words beyond the %u of %s (see -nword)\n",append,corpus.n_word,dat);
+		first = corpus.n_doc;
+		corpus.append(c);
+	}
 	if(verbosity>0)
 	{
+		fprintf(stderr,"#doc:	%u\n",corpus.n_doc);
+		fprintf(stderr,"#word:	%u\n",corpus.n_word);
 		fprintf(stderr,"alpha:	%8lf\n",alpha);
 		fprintf(stderr,"beta:	%8lf\n",beta);
 		fprintf(stderr,"gamma:	%8lf\n",gamma);
+		fprintf(stderr,"threads:	%u\n",direct?1:n_thread);
+		if(NULL!=server)
+			fprintf(stderr,"worker:	%u of %u, docs from %u\n",rank,n_rank,doc_base);
+	}
+	if(direct)
+	{
+		Direct da(corpus.n_doc,corpus.n_word);
+		da.set_data(corpus);
+		da.config(alpha,beta,gamma);
+		da.set_layout(layout);
+		da.seed = seed;
+		da.init();
+		lcg64(seed);
+		da.summary(verbosity);
+		for(uint32_t i=1;i<=max_iter;i++) {
+			mt.begin();
+			mt.start();
+			da.gibbs();
+			mt.stop(Metrics::TABLE);
+			mt.n_token += da.dat.n_token;
+			bool stop = heldout_stop(ho,da,i,mt,verbosity);
+			if(verbosity>0)
+				printf("iter: %3u\t",i);
+			mt.start();
+			if(i%out_iter==0 or stop)
+				out_writer.write(da,outdir,i);
+			mt.stop(Metrics::OUTPUT);
+			da.summary(verbosity);
+			mt.write(i,da,loglik_every>0 and i%loglik_every==0);
+			if(stop)
+				break;
+		}
+		out_writer.wait();
+		return 0;
+	}
+	HDP hdp(corpus.n_doc,corpus.n_word);
+	hdp.set_data(corpus);
+	hdp.config(alpha,beta,gamma);
+	hdp.set_threads(n_thread);
+	hdp.set_layout(layout);
+	hdp.sampler = sampler;
+	hdp.mh_steps = mh_steps;
+	hdp.menu_commit = menu_commit;
+	hdp.seed = seed; // replaced by the saved one with -resume
+	hdp.doc_base = doc_base;
+	DistWorker dw;
+	if(NULL!=server)
+		dw.connect(server,rank,n_rank,corpus.n_word);
+	uint32_t start = 1;
+	if(NULL!=append)
+	{
+		uint32_t n_saved;
+		hdp.load(resume,&n_saved);
+		if(n_saved!=first)
+			error("%s is for %u docs, %s has %u\n",resume,n_saved,dat,first);
+		hdp.init(first);
+		lcg64(seed);
+	}
+	else if(NULL!=resume)
+		start = hdp.load(resume)+1; // RNG state included
+	else if(NULL!=server)
+	{
+		dw.start(hdp);
+		hdp.init();
+		dw.sync(hdp);
+		lcg64(seed);
+	}
+	else
+	{
+		hdp.init();
+		lcg64(seed);
 	}
-	hdp.init();
 	hdp.summary(verbosity);
-	lcg64(seed);
-	for(uint32_t i=1;i<=max_iter;i++) {
-		hdp.gibbs_table();
-		hdp.remove_empty();
-		hdp.gibbs_menu();
-		hdp.remove_empty();
+	char checkpoint_fname[4096]; //overflow?
+	sprintf(checkpoint_fname,"%s/checkpoint.bin",outdir);
+	for(uint32_t i=start;i<=max_iter;i++) {
+		mt.begin();
+		// New docs first, old ones now and then
+		for(uint32_t j=0;first>0 and j<new_sweeps;j++)
+			sweep(hdp,first,mt,NULL);
+		if(first==0 or (old_every>0 and i%old_every==0))
+			sweep(hdp,0,mt,NULL!=server?&dw:NULL);
+		if(split_every>0 and i%split_every==0)
+		{
+			mt.start();
+			uint32_t n = hdp.split_merge(split_pairs);
+			hdp.remove_empty();
+			mt.stop(Metrics::SPLIT);
+			if(verbosity>1)
+				printf("split-merge: %u moves\n",n);
+		}
+		bool stop = heldout_stop(ho,hdp,i,mt,verbosity);
 		if(verbosity>0)
 			printf("iter: %3u\t",i);
-		if(i%out_iter==0) {
-			char topic_fname[4096]; //overflow?
-			char assign_fname[4096]; //overflow?
-			sprintf(topic_fname,"%s/%04d_topics.txt",outdir,i);
-			sprintf(assign_fname,"%s/%04d_assignments.txt",outdir,i);
-			FILE* topic_f = fopen(topic_fname,"w");
-			FILE* assign_f = fopen(assign_fname,"w");
-			hdp.output_topics(topic_f);
-			hdp.output_assignments(assign_f);
-			fclose(topic_f);
-			fclose(assign_f);
-		}
+		mt.start();
+		if(i%out_iter==0 or stop)
+			out_writer.write(hdp,outdir,i); // in background
+		mt.stop(Metrics::OUTPUT);
 		hdp.summary(verbosity);
+		mt.start();
+		if(checkpoint_every>0 and (i%checkpoint_every==0 or stop))
+			hdp.save(checkpoint_fname,i);
+		mt.stop(Metrics::CHECKPOINT);
+		mt.write(i,hdp,loglik_every>0 and i%loglik_every==0);
+		if(stop)
+			break;
 	}
+	out_writer.wait();
+	if(NULL!=server)
+		dw.close(hdp);
 	return 0;
 }
 
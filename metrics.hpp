@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <sys/resource.h>
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * Per-iteration metrics, one JSON object per line:
+ *   {"iter":..,"sec":{"gibbs_table":..,...,"total":..},"tokens_per_sec":..,
+ *    "n_menu":..,"n_table":..,"peak_rss_kb":..,"perplexity":..,"loglik":..}
+ * perplexity (held-out) and loglik are null in iterations where they are
+ * not computed.
+ */
+class Metrics
+{
+public:
+	enum Phase { TABLE, EMPTY, MENU, SYNC, SPLIT, HELDOUT, OUTPUT, CHECKPOINT, N_PHASE };
+
+	FILE* f;
+	double sec[N_PHASE];
+	uint64_t n_token; // tokens sampled by gibbs_table
+	double perplexity; // held-out, NAN if not computed
+	double t_phase; // start of the current phase
+	double t_iter; // start of the iteration
+
+	Metrics(): f(NULL) { begin(); }
+
+	~Metrics() { close(); }
+
+	void open(const char* filename)
+	{
+		if(!(f=fopen(filename,"w")))
+			error("Cannot open %s for writing.\n",filename);
+	}
+
+	void close()
+	{
+		if(NULL!=f)
+			fclose(f);
+		f = NULL;
+	}
+
+	static double now()
+	{
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC,&t);
+		return t.tv_sec+t.tv_nsec*1e-9;
+	}
+
+	// Start of an iteration
+	void begin()
+	{
+		for(uint32_t j=0;j<N_PHASE;j++)
+			sec[j] = 0;
+		n_token = 0;
+		perplexity = NAN;
+		t_iter = t_phase = now();
+	}
+
+	void start() { t_phase = now(); }
+
+	// Add the time since start() to phase j
+	void stop(Phase j) { sec[j] += now()-t_phase; }
+
+	// Write the line of iteration iter of h, HDP or Direct (loglik if
+	// with_loglik)
+	template <typename E>
+	void write(uint32_t iter, E& h, bool with_loglik)
+	{
+		if(NULL==f)
+			return;
+		double total = now()-t_iter;
+		struct rusage ru;
+		getrusage(RUSAGE_SELF,&ru);
+		fprintf(f,"{\"iter\":%u,\"sec\":{\"gibbs_table\":%.6f,\"remove_empty\":%.6f,"
+				"\"gibbs_menu\":%.6f,\"sync\":%.6f,\"split_merge\":%.6f,\"heldout\":%.6f,\"output\":%.6f,\"checkpoint\":%.6f,\"total\":%.6f},",
+				iter,sec[TABLE],sec[EMPTY],sec[MENU],sec[SYNC],sec[SPLIT],sec[HELDOUT],sec[OUTPUT],sec[CHECKPOINT],total);
+		fprintf(f,"\"tokens_per_sec\":%.1f,\"n_menu\":%u,\"n_table\":%u,\"peak_rss_kb\":%ld,",
+				sec[TABLE]>0?n_token/sec[TABLE]:0.0,h.menu_stat.len,h.menu_stat_sum,
+				(long)ru.ru_maxrss);
+		if(std::isfinite(perplexity))
+			fprintf(f,"\"perplexity\":%.4f,",perplexity);
+		else
+			fprintf(f,"\"perplexity\":null,");
+		double ll = with_loglik?h.loglik():NAN;
+		if(std::isfinite(ll))
+			fprintf(f,"\"loglik\":%.6f}\n",ll);
+		else
+			fprintf(f,"\"loglik\":null}\n");
+		fflush(f);
+	}
+};
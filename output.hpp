@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <pthread.h>
+#include "vec.hpp"
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * Writes topics (menu x word counts) and assignments (doc x menu counts)
+ * of an HDP in a background thread: write() only copies the nonzero
+ * counts, formatting and I/O overlap with the following sweeps.
+ *
+ * Formats:
+ *   DENSE   tab-separated rows of all counts (as output_topics())
+ *   SPARSE  a row per line as in lda-c, "n id:count id:count ..."
+ *   BINARY  uint32_t magic, version, n_row, n_col, then
+ *           uint64_t offset[n_row+1], uint32_t id[nnz], uint32_t count[nnz]
+ * With top_n>0, SPARSE and BINARY keep the top_n words of each topic,
+ * by decreasing count; otherwise ids are increasing.
+ */
+class Output
+{
+public:
+	enum Format { DENSE, SPARSE, BINARY };
+	enum { MAGIC = 0x4f504448u, VERSION = 1 }; // "HDPO"
+
+	struct Pair
+	{
+		uint32_t id;
+		uint32_t n;
+	};
+
+	/**
+	 * Rows of nonzero counts
+	 */
+	struct Table
+	{
+		uint32_t n_col;
+		Vec<uint32_t> off; // row r is id/n[off[r]],...,id/n[off[r+1]-1]
+		Vec<uint32_t> id;
+		Vec<uint32_t> n;
+	};
+
+	Format format;
+	uint32_t top_n;
+
+	Table topic;
+	Table assign;
+	char topic_fname[4096]; //overflow?
+	char assign_fname[4096];
+	bool running;
+	pthread_t th;
+	Vec<uint32_t> cnt; // scratch of write()
+
+	Output(): format(DENSE), top_n(0), running(false) {}
+
+	~Output() { wait(); }
+
+	// Wait for the last write() to finish
+	void wait()
+	{
+		if(!running)
+			return;
+		pthread_join(th,NULL);
+		running = false;
+	}
+
+	// Write the state of h (HDP or Direct) after iteration iter to outdir
+	template <typename E>
+	void write(E& h, const char* outdir, uint32_t iter)
+	{
+		wait();
+		const char* ext = (format==BINARY)?"bin":"txt";
+		snprintf(topic_fname,sizeof(topic_fname),"%s/%04d_topics.%s",outdir,iter,ext);
+		snprintf(assign_fname,sizeof(assign_fname),"%s/%04d_assignments.%s",outdir,iter,ext);
+		// Copy topics
+		uint32_t n_menu = h.menu_stat.len;
+		topic.n_col = h.n_word;
+		clear(topic);
+		for(uint32_t k=0;k<n_menu;k++)
+		{
+			h.word_stat.row_pairs(k,topic.id,topic.n);
+			topic.off.push_back(topic.id.len);
+		}
+		// Copy assignments
+		assign.n_col = n_menu;
+		clear(assign);
+		cnt.resize(n_menu);
+		if(n_menu>0)
+			memset(&(cnt[0]),0,n_menu*sizeof(uint32_t));
+		for(uint32_t d=0;d<h.n_doc;d++)
+		{
+			uint32_t begin = assign.id.len;
+			h.doc_menus(d,cnt,assign.id);
+			for(uint32_t i=begin;i<assign.id.len;i++)
+			{
+				assign.n.push_back(cnt[assign.id[i]]);
+				cnt[assign.id[i]] = 0;
+			}
+			assign.off.push_back(assign.id.len);
+		}
+		running = true;
+		if(pthread_create(&th,NULL,run,this))
+			error("Cannot create writer thread.\n");
+	}
+
+private:
+	static void clear(Table& x)
+	{
+		x.off.clear();
+		x.off.push_back(0);
+		x.id.clear();
+		x.n.clear();
+	}
+
+	static void* run(void* arg)
+	{
+		Output& o = *(Output*)arg;
+		o.write_table(o.topic,o.topic_fname,o.top_n);
+		o.write_table(o.assign,o.assign_fname,0);
+		return NULL;
+	}
+
+	static int cmp_id(const void* a, const void* b)
+	{
+		uint32_t x = ((const Pair*)a)->id, y = ((const Pair*)b)->id;
+		return (x>y)-(x<y);
+	}
+
+	// By decreasing count, then increasing id
+	static int cmp_n(const void* a, const void* b)
+	{
+		const Pair* x = (const Pair*)a;
+		const Pair* y = (const Pair*)b;
+		if(x->n!=y->n)
+			return (x->n<y->n)-(x->n>y->n);
+		return (x->id>y->id)-(x->id<y->id);
+	}
+
+	/**
+	 * Buffered text output of unsigned integers
+	 */
+	struct Text
+	{
+		FILE* f;
+		char buf[1<<16];
+		uint32_t len;
+
+		void flush()
+		{
+			if(len>0)
+				qassert(1==fwrite(buf,len,1,f));
+			len = 0;
+		}
+
+		void put(uint32_t x, char sep)
+		{
+			if(len+12>sizeof(buf))
+				flush();
+			char tmp[10];
+			int i = 0;
+			do {
+				tmp[i++] = '0'+x%10;
+				x /= 10;
+			} while(x>0);
+			while(i>0)
+				buf[len++] = tmp[--i];
+			buf[len++] = sep;
+		}
+	};
+
+	void write_table(Table& x, const char* filename, uint32_t top)
+	{
+		FILE* f = fopen(filename,(format==BINARY)?"wb":"w");
+		if(!f)
+			error("Cannot open %s for writing.\n",filename);
+		uint32_t n_row = x.off.len-1;
+		Vec<Pair> row;
+		Vec<uint64_t> off;
+		Vec<uint32_t> id, n;
+		Vec<uint32_t> dense;
+		Text* tx = new Text;
+		tx->f = f;
+		tx->len = 0;
+		off.push_back(0);
+		for(uint32_t r=0;r<n_row;r++)
+		{
+			// Sorted row
+			row.clear();
+			for(uint32_t i=x.off[r];i<x.off[r+1];i++)
+			{
+				Pair p = {x.id[i],x.n[i]};
+				row.push_back(p);
+			}
+			if(row.len>0)
+				qsort(&(row[0]),row.len,sizeof(Pair),top>0?cmp_n:cmp_id);
+			if(top>0 and row.len>top)
+				row.len = top;
+			if(format==DENSE)
+			{
+				dense.resize(x.n_col);
+				if(x.n_col>0)
+					memset(&(dense[0]),0,x.n_col*sizeof(uint32_t));
+				for(uint32_t i=0;i<row.len;i++)
+					dense[row[i].id] = row[i].n;
+				for(uint32_t c=0;c<x.n_col;c++)
+					tx->put(dense[c],(c+1<x.n_col)?'\t':'\n');
+			}
+			else if(format==SPARSE)
+			{
+				tx->put(row.len,row.len>0?' ':'\n');
+				for(uint32_t i=0;i<row.len;i++)
+				{
+					tx->put(row[i].id,':');
+					tx->put(row[i].n,(i+1<row.len)?' ':'\n');
+				}
+			}
+			else
+			{
+				for(uint32_t i=0;i<row.len;i++)
+				{
+					id.push_back(row[i].id);
+					n.push_back(row[i].n);
+				}
+				off.push_back(id.len);
+			}
+		}
+		if(format==BINARY)
+		{
+			uint32_t h[4] = {MAGIC,VERSION,n_row,x.n_col};
+			qassert(1==fwrite(h,sizeof(h),1,f));
+			qassert(off.len==fwrite(off.head,sizeof(uint64_t),off.len,f));
+			if(id.len>0)
+			{
+				qassert(id.len==fwrite(id.head,sizeof(uint32_t),id.len,f));
+				qassert(n.len==fwrite(n.head,sizeof(uint32_t),n.len,f));
+			}
+		}
+		tx->flush();
+		delete tx;
+		qassert(0==fclose(f));
+	}
+};
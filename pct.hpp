@@ -1,54 +1,139 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include "qlog.hpp"
+
+// Entries in float halve the cache footprint of the tables
+#ifdef PCT_FLOAT
+typedef float pct_t;
+#else
+typedef double pct_t;
+#endif
 
 /*
- * Pre-Computed Table for lgamma(i+delta)
+ * Pre-Computed Table for func(i+delta), i<cap
+ *
+ * Entries are computed in chunks when first looked up, and never change
+ * once published, so threads read them without locks. The tables are
+ * shared by all PCTs of the same func and delta in the process (threads
+ * and chains). Beyond cap, func is called.
  */
 class PCT
 {
 public:
-	uint32_t len;
-	double (*func)(double);
-	double delta;
-	double * x;
+	enum { CHUNK = 4096 };
+
+	struct Table
+	{
+		double (*func)(double);
+		double delta;
+		uint32_t cap;
+		uint32_t filled; // x[0..filled) are computed
+		pct_t* x; // cap entries, pages are touched as filled
+		uint32_t ref;
+		Table* next;
+	};
 
-	PCT() : len(0), func(NULL), delta(0), x(NULL) {}
+	Table* t;
 
-	PCT(uint32_t _len, double (*_func)(double), double _delta)
-		: len(0), func(NULL), delta(0), x(NULL)
+	PCT() : t(NULL) {}
+
+	PCT(uint32_t _cap, double (*_func)(double), double _delta)
+		: t(NULL)
 	{
-		make(_len,_func,_delta);
+		make(_cap,_func,_delta);
 	}
 
+	~PCT() { dtor(); }
+
 	void dtor()
 	{
-		if(NULL!=x)
+		if(NULL==t)
+			return;
+		pthread_mutex_lock(&lock());
+		if(0==--t->ref)
 		{
-			free(x);
-			x = NULL;
+			Table** p = &list();
+			while(*p!=t)
+				p = &((*p)->next);
+			*p = t->next;
+			free(t->x);
+			free(t);
 		}
+		pthread_mutex_unlock(&lock());
+		t = NULL;
 	}
 
-	void make(uint32_t _len, double (*_func)(double), double _delta)
-	{
-		len = _len;
-		func = _func;
-		delta = _delta;
-		if(NULL!=x)
-			free(x);
-		x = (double*)malloc(len*sizeof(double));
-		for(uint32_t i=0;i<len;i++)
-			x[i] = i + delta;
-		for(uint32_t i=0;i<len;i++)
-			x[i] = func(x[i]);
+	// Use the shared table of (func,delta) with at least cap entries
+	void make(uint32_t cap, double (*func)(double), double delta)
+	{
+		dtor();
+		pthread_mutex_lock(&lock());
+		for(t=list();NULL!=t;t=t->next)
+			if(t->func==func and t->delta==delta and t->cap>=cap)
+				break;
+		if(NULL==t)
+		{
+			t = (Table*)malloc(sizeof(Table));
+			t->func = func;
+			t->delta = delta;
+			t->cap = cap;
+			t->filled = 0;
+			t->x = (pct_t*)malloc((uint64_t)cap*sizeof(pct_t));
+			if(cap>0 and NULL==t->x)
+				error("Cannot allocate a table of %u entries\n",cap);
+			t->ref = 0;
+			t->next = list();
+			list() = t;
+		}
+		t->ref++;
+		pthread_mutex_unlock(&lock());
 	}
 
-	double operator()(uint32_t i)
+	uint32_t len() const { return __atomic_load_n(&t->filled,__ATOMIC_ACQUIRE); }
+
+	pct_t operator()(uint32_t i) const
 	{
-		if(i<len)
-			return x[i];
-		return func(i+delta);
+		if(likely(i<len()))
+			return t->x[i];
+		return miss(i);
 	}
-};
 
+private:
+	// A copy would release the shared table twice
+	PCT(const PCT&) = delete;
+	PCT& operator=(const PCT&) = delete;
+
+	// Fill the chunks up to the one of i (out of line, to keep
+	// operator() small enough to inline)
+	__attribute__((noinline)) pct_t miss(uint32_t i) const
+	{
+		if(i>=t->cap)
+			return t->func(i+t->delta);
+		pthread_mutex_lock(&lock());
+		uint32_t n = t->filled;
+		uint32_t end = (i/CHUNK+1)*CHUNK;
+		if(end>t->cap or end<i)
+			end = t->cap;
+		for(;n<end;n++)
+			t->x[n] = t->func(n+t->delta);
+		if(end>t->filled)
+			__atomic_store_n(&t->filled,end,__ATOMIC_RELEASE);
+		pthread_mutex_unlock(&lock());
+		return t->x[i];
+	}
+
+	static pthread_mutex_t& lock()
+	{
+		static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+		return m;
+	}
+
+	static Table*& list()
+	{
+		static Table* l = NULL;
+		return l;
+	}
+};
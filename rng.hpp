@@ -1,38 +1,160 @@
 #pragma once
 #include "qlog.hpp"
+#include "simd.hpp"
 
 #include <cstdint>
+#include <cmath>
 #define A_Default (18145460002477866997ull)
 
 static uint64_t __lcg64_r = 0;
 
-inline uint64_t lcg64(void)
+/**
+ * Reentrant version, the state is kept by the caller (one per thread).
+ */
+inline uint64_t lcg64_r(uint64_t * const r)
 {
-	uint64_t * const r = &__lcg64_r;
 	const uint64_t a = A_Default;
 	const uint64_t b = 1;
 	(*r) = ((*r)*a + b);
 	return (*r);
 }
 
+inline uint64_t lcg64(void)
+{
+	return lcg64_r(&__lcg64_r);
+}
+
 inline void lcg64(uint64_t seed)
 {
 	__lcg64_r = seed;
 }
 
-inline double drand(void)
+inline double drand_r(uint64_t * const r)
 {
 	uint64_t M = ~0ull;
-	return((double)lcg64()/M);
+	return((double)lcg64_r(r)/M);
 }
 
+inline double drand(void)
+{
+	return drand_r(&__lcg64_r);
+}
+
+/**
+ * Philox4x32-10 (Salmon et al., 2011): block ctr of the stream key.
+ * A pure function of (ctr,key), so blocks of any stream can be made
+ * in any order by any thread. Lane j of the arrays is an independent
+ * block, N blocks at a time so that the rounds vectorize.
+ */
+template <uint32_t N>
+inline void philox4x32(uint32_t (*x)[N], const uint32_t key[2])
+{
+	uint32_t k0 = key[0], k1 = key[1];
+	for(uint32_t r=0;r<10;r++)
+	{
+		for(uint32_t j=0;j<N;j++)
+		{
+			uint64_t p0 = (uint64_t)0xD2511F53u*x[0][j];
+			uint64_t p1 = (uint64_t)0xCD9E8D57u*x[2][j];
+			uint32_t y0 = (uint32_t)(p1>>32)^x[1][j]^k0;
+			uint32_t y2 = (uint32_t)(p0>>32)^x[3][j]^k1;
+			x[0][j] = y0;
+			x[1][j] = (uint32_t)p1;
+			x[2][j] = y2;
+			x[3][j] = (uint32_t)p0;
+		}
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+}
+
+/**
+ * Counter-based stream (a,b,c) of seed: uniform i comes from block
+ * i/2 of philox4x32 with counter {i/2,a,b,c}, so the numbers drawn for
+ * e.g. (doc,sweep,kind) do not depend on the thread that draws them.
+ * Uniforms are made BUF at a time.
+ */
+class Rng
+{
+public:
+	enum { BUF = 16, LANE = 4 };
+
+	uint32_t key[2];
+	uint32_t ctr[4];
+	double u[BUF];
+	uint32_t pos;
+
+	Rng() { set(0,0,0,0); }
+
+	// Start stream (a,b,c) of seed
+	void set(uint64_t seed, uint32_t a, uint32_t b, uint32_t c)
+	{
+		key[0] = (uint32_t)seed;
+		key[1] = (uint32_t)(seed>>32);
+		ctr[0] = 0;
+		ctr[1] = a;
+		ctr[2] = b;
+		ctr[3] = c;
+		pos = BUF;
+	}
+
+	// Next n uniforms in (0,1) to x (n even)
+	void fill(double* x, uint32_t n)
+	{
+		uint32_t b[4][LANE];
+		while(n>0)
+		{
+			uint32_t m = n<2*LANE?n/2:LANE;
+			for(uint32_t j=0;j<LANE;j++)
+			{
+				b[0][j] = ctr[0]+j;
+				b[1][j] = ctr[1];
+				b[2][j] = ctr[2];
+				b[3][j] = ctr[3];
+			}
+			philox4x32<LANE>(b,key);
+			for(uint32_t j=0;j<m;j++)
+			{
+				x[2*j] = uniform(b[0][j],b[1][j]);
+				x[2*j+1] = uniform(b[2][j],b[3][j]);
+			}
+			ctr[0] += m;
+			x += 2*m;
+			n -= 2*m;
+		}
+	}
+
+	double drand()
+	{
+		if(pos==BUF)
+		{
+			fill(u,BUF);
+			pos = 0;
+		}
+		return u[pos++];
+	}
+
+	// 53 random bits, never 0 or 1
+	static double uniform(uint32_t hi, uint32_t lo)
+	{
+		uint64_t x = ((uint64_t)hi<<32|lo)>>11;
+		return ((int64_t)x+0.5)*(1.0/9007199254740992.0); // x<2^53
+	}
+};
+
+inline double drand_r(Rng* const r)
+{
+	return r->drand();
+}
+
+// Fisher-Yates
 template <typename T>
 void shuffle(T* x, uint32_t len)
 {
 	T t;
-	for(uint32_t i=0;i<len-1;i++)
+	for(uint32_t i=0;i+1<len;i++)
 	{
-		uint32_t j = i+lcg64()%(len-1-i);
+		uint32_t j = i+lcg64()%(len-i);
 		// swap x[i] & x[j]
 		t = x[i];
 		x[i] = x[j];
@@ -48,8 +170,8 @@ void shuffle(T* x, uint32_t len)
  * 		return in [0,len-1]
  * 		Cumulative Prob in (without normalization) in cum
  */
-template <typename T>
-inline uint32_t rmultinorm(T* p, T* cum, uint32_t len, bool cal_cum=true)
+template <typename T, typename R>
+inline uint32_t rmultinorm_r(R * const rs, T* p, T* cum, uint32_t len, bool cal_cum=true)
 // Sequential search is faster for small size prob array
 #define SEQ_SEARCH
 {
@@ -59,7 +181,7 @@ inline uint32_t rmultinorm(T* p, T* cum, uint32_t len, bool cal_cum=true)
 		for(uint32_t i=1;i<len;i++)
 			cum[i] = cum[i-1] + p[i];
 	}
-	double r = drand()*cum[len-1];
+	double r = drand_r(rs)*cum[len-1];
 #ifndef SEQ_SEARCH
 	uint32_t med = len/2;
 	uint32_t low=0;
@@ -83,3 +205,52 @@ inline uint32_t rmultinorm(T* p, T* cum, uint32_t len, bool cal_cum=true)
 	return(~0u);
 }
 
+// With the SIMD kernels for double
+template <typename R>
+inline uint32_t rmultinorm_r(R * const rs, double* p, double* cum, uint32_t len, bool cal_cum=true)
+{
+	SimdKernels& s = simd();
+	if(cal_cum)
+		s.cumsum(p,cum,len);
+	return s.search(cum,len,drand_r(rs)*cum[len-1]);
+}
+
+template <typename T>
+inline uint32_t rmultinorm(T* p, T* cum, uint32_t len, bool cal_cum=true)
+{
+	return rmultinorm_r(&__lcg64_r,p,cum,len,cal_cum);
+}
+
+
+// Standard normal (Box-Muller, one of the pair); uniforms must not be 0
+template <typename R>
+inline double rnorm_r(R * const rs)
+{
+	double u = drand_r(rs), v = drand_r(rs);
+	return sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+/**
+ * Gamma(shape,1) (Marsaglia and Tsang, 2000), shape<1 through
+ * Gamma(shape+1)*U^(1/shape). Uniforms must not be 0 (as from Rng).
+ */
+template <typename R>
+inline double rgamma_r(R * const rs, double shape)
+{
+	if(shape<1)
+		return rgamma_r(rs,shape+1)*pow(drand_r(rs),1/shape);
+	double d = shape-1.0/3;
+	double c = 1/sqrt(9*d);
+	for(;;)
+	{
+		double x, v;
+		do {
+			x = rnorm_r(rs);
+			v = 1+c*x;
+		} while(v<=0);
+		v = v*v*v;
+		double u = drand_r(rs);
+		if(log(u)<0.5*x*x+d-d*v+d*log(v))
+			return d*v;
+	}
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+#include "qlog.hpp"
+
+/**
+ * Kernels on double arrays of the samplers, chosen at run time among
+ * scalar, AVX2 and AVX-512 versions. All versions do the same
+ * floating-point operations in the same order (no FMA, sums in 4
+ * lanes), so the results are bit-identical on any CPU:
+ *   simd_finite_mean(x,n)  sum of the finite x[i], over n
+ *   simd_exp_shift(x,n,s)  x[i] = exp(x[i]-s), 0 below -708
+ *   simd_cumsum(p,c,n)     prefix sums of p, in blocks of 4
+ *   simd_search(c,n,r)     first i with c[i]>=r, ~0u if none
+ */
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512, SIMD_AUTO };
+
+// A fused multiply-add would round differently from the other versions
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized" // in avx512fintrin.h
+#endif
+
+namespace simd_scalar {
+
+// exp() of Cephes: x = n*ln2+r, exp(r) by a Pade approximant, then 2^n
+inline double exp1(double x)
+{
+	if(!(x>=-708.0))
+		return 0; // and -inf, NaN
+	if(x>709.0)
+		return INFINITY;
+	double n = std::nearbyint(x*1.4426950408889634074);
+	x = x-n*6.93145751953125E-1;
+	x = x-n*1.42860682030941723212E-6;
+	double xx = x*x;
+	double px = x*((1.26177193074810590878E-4*xx+3.02994407707441961300E-2)*xx+9.99999999999999999910E-1);
+	double qx = ((3.00198505138664455042E-6*xx+2.52448340349684104192E-3)*xx+2.27265548208155028766E-1)*xx+2.00000000000000000009E0;
+	x = px/(qx-px);
+	x = 1.0+2.0*x;
+	uint64_t b = (uint64_t)((int64_t)n+1023)<<52;
+	double s;
+	memcpy(&s,&b,sizeof(s));
+	return x*s;
+}
+
+inline double finite_mean(const double* x, uint32_t len)
+{
+	double s[4] = {0,0,0,0};
+	for(uint32_t i=0;i<len;i++)
+		if(likely(std::isfinite(x[i])))
+			s[i%4] += x[i];
+	return ((s[0]+s[1])+(s[2]+s[3]))/len;
+}
+
+inline void exp_shift(double* x, uint32_t len, double s)
+{
+	for(uint32_t i=0;i<len;i++)
+		x[i] = exp1(x[i]-s);
+}
+
+// Prefix sums of a block of 4 (zero padded) after carry, as in AVX2
+inline void cumsum4(const double* p, double* c, uint32_t n, double carry)
+{
+	double a[4] = {0,0,0,0};
+	for(uint32_t j=0;j<n;j++)
+		a[j] = p[j];
+	double y1 = a[1]+a[0], y2 = a[2]+a[1], y3 = a[3]+a[2];
+	double z[4] = {a[0], y1, y2+a[0], y3+y1};
+	for(uint32_t j=0;j<n;j++)
+		c[j] = z[j]+carry;
+}
+
+inline void cumsum(const double* p, double* c, uint32_t len)
+{
+	double carry = 0;
+	for(uint32_t i=0;i<len;i+=4)
+	{
+		cumsum4(p+i,c+i,len-i<4?len-i:4,carry);
+		carry = c[i+(len-i<4?len-i:4)-1];
+	}
+}
+
+inline uint32_t search(const double* c, uint32_t len, double r)
+{
+	for(uint32_t i=0;i<len;i++)
+		if(c[i]>=r)
+			return i;
+	return ~0u;
+}
+
+}
+
+#ifdef SIMD_X86
+namespace simd_avx2 {
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256d exp4(__m256d x)
+{
+	__m256d lo = _mm256_cmp_pd(x,_mm256_set1_pd(-708.0),_CMP_NGE_UQ);
+	__m256d hi = _mm256_cmp_pd(x,_mm256_set1_pd(709.0),_CMP_GT_OQ);
+	x = _mm256_min_pd(_mm256_max_pd(x,_mm256_set1_pd(-708.0)),_mm256_set1_pd(709.0));
+	__m256d n = _mm256_round_pd(_mm256_mul_pd(x,_mm256_set1_pd(1.4426950408889634074)),
+			_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	x = _mm256_sub_pd(x,_mm256_mul_pd(n,_mm256_set1_pd(6.93145751953125E-1)));
+	x = _mm256_sub_pd(x,_mm256_mul_pd(n,_mm256_set1_pd(1.42860682030941723212E-6)));
+	__m256d xx = _mm256_mul_pd(x,x);
+	__m256d px = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(1.26177193074810590878E-4),xx),
+			_mm256_set1_pd(3.02994407707441961300E-2));
+	px = _mm256_add_pd(_mm256_mul_pd(px,xx),_mm256_set1_pd(9.99999999999999999910E-1));
+	px = _mm256_mul_pd(x,px);
+	__m256d qx = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(3.00198505138664455042E-6),xx),
+			_mm256_set1_pd(2.52448340349684104192E-3));
+	qx = _mm256_add_pd(_mm256_mul_pd(qx,xx),_mm256_set1_pd(2.27265548208155028766E-1));
+	qx = _mm256_add_pd(_mm256_mul_pd(qx,xx),_mm256_set1_pd(2.00000000000000000009E0));
+	x = _mm256_div_pd(px,_mm256_sub_pd(qx,px));
+	x = _mm256_add_pd(_mm256_set1_pd(1.0),_mm256_mul_pd(_mm256_set1_pd(2.0),x));
+	// 2^n: n+1023 in the low bits of 2^52+2^51+n+1023, shifted to the exponent
+	__m256d b = _mm256_add_pd(n,_mm256_set1_pd(6755399441055744.0+1023));
+	__m256d s = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(b),52));
+	x = _mm256_mul_pd(x,s);
+	x = _mm256_blendv_pd(x,_mm256_setzero_pd(),lo);
+	return _mm256_blendv_pd(x,_mm256_set1_pd(INFINITY),hi);
+}
+
+AVX2 inline double finite_mean(const double* x, uint32_t len)
+{
+	__m256d s = _mm256_setzero_pd();
+	uint32_t i = 0;
+	for(;i+4<=len;i+=4)
+	{
+		__m256d v = _mm256_loadu_pd(x+i);
+		// x-x is 0 if x is finite, NaN otherwise
+		__m256d ok = _mm256_cmp_pd(_mm256_sub_pd(v,v),_mm256_setzero_pd(),_CMP_EQ_OQ);
+		s = _mm256_add_pd(s,_mm256_and_pd(v,ok));
+	}
+	double t[4];
+	_mm256_storeu_pd(t,s);
+	for(;i<len;i++)
+		if(likely(std::isfinite(x[i])))
+			t[i%4] += x[i];
+	return ((t[0]+t[1])+(t[2]+t[3]))/len;
+}
+
+AVX2 inline void exp_shift(double* x, uint32_t len, double s)
+{
+	__m256d vs = _mm256_set1_pd(s);
+	uint32_t i = 0;
+	for(;i+4<=len;i+=4)
+		_mm256_storeu_pd(x+i,exp4(_mm256_sub_pd(_mm256_loadu_pd(x+i),vs)));
+	for(;i<len;i++)
+		x[i] = simd_scalar::exp1(x[i]-s);
+}
+
+AVX2 inline void cumsum(const double* p, double* c, uint32_t len)
+{
+	__m256d carry = _mm256_setzero_pd();
+	uint32_t i = 0;
+	for(;i+4<=len;i+=4)
+	{
+		__m256d x = _mm256_loadu_pd(p+i);
+		// x + [0,x0,x1,x2], then + [0,0,y0,y1]
+		__m256d y = _mm256_blend_pd(_mm256_permute4x64_pd(x,_MM_SHUFFLE(2,1,0,0)),
+				_mm256_setzero_pd(),1);
+		y = _mm256_add_pd(x,y);
+		__m256d z = _mm256_add_pd(y,_mm256_permute2f128_pd(y,y,0x08));
+		z = _mm256_add_pd(z,carry);
+		_mm256_storeu_pd(c+i,z);
+		carry = _mm256_permute4x64_pd(z,_MM_SHUFFLE(3,3,3,3));
+	}
+	if(i<len)
+		simd_scalar::cumsum4(p+i,c+i,len-i,i>0?c[i-1]:0);
+}
+
+AVX2 inline uint32_t search(const double* c, uint32_t len, double r)
+{
+	__m256d vr = _mm256_set1_pd(r);
+	uint32_t i = 0;
+	for(;i+4<=len;i+=4)
+	{
+		int m = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(c+i),vr,_CMP_GE_OQ));
+		if(m)
+			return i+__builtin_ctz(m);
+	}
+	for(;i<len;i++)
+		if(c[i]>=r)
+			return i;
+	return ~0u;
+}
+
+#undef AVX2
+}
+
+namespace simd_avx512 {
+
+#define AVX512 __attribute__((target("avx512f")))
+
+// Same steps as simd_avx2::exp4()
+AVX512 inline __m512d exp8(__m512d x)
+{
+	__mmask8 lo = _mm512_cmp_pd_mask(x,_mm512_set1_pd(-708.0),_CMP_NGE_UQ);
+	__mmask8 hi = _mm512_cmp_pd_mask(x,_mm512_set1_pd(709.0),_CMP_GT_OQ);
+	x = _mm512_min_pd(_mm512_max_pd(x,_mm512_set1_pd(-708.0)),_mm512_set1_pd(709.0));
+	__m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x,_mm512_set1_pd(1.4426950408889634074)),
+			_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	x = _mm512_sub_pd(x,_mm512_mul_pd(n,_mm512_set1_pd(6.93145751953125E-1)));
+	x = _mm512_sub_pd(x,_mm512_mul_pd(n,_mm512_set1_pd(1.42860682030941723212E-6)));
+	__m512d xx = _mm512_mul_pd(x,x);
+	__m512d px = _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(1.26177193074810590878E-4),xx),
+			_mm512_set1_pd(3.02994407707441961300E-2));
+	px = _mm512_add_pd(_mm512_mul_pd(px,xx),_mm512_set1_pd(9.99999999999999999910E-1));
+	px = _mm512_mul_pd(x,px);
+	__m512d qx = _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(3.00198505138664455042E-6),xx),
+			_mm512_set1_pd(2.52448340349684104192E-3));
+	qx = _mm512_add_pd(_mm512_mul_pd(qx,xx),_mm512_set1_pd(2.27265548208155028766E-1));
+	qx = _mm512_add_pd(_mm512_mul_pd(qx,xx),_mm512_set1_pd(2.00000000000000000009E0));
+	x = _mm512_div_pd(px,_mm512_sub_pd(qx,px));
+	x = _mm512_add_pd(_mm512_set1_pd(1.0),_mm512_mul_pd(_mm512_set1_pd(2.0),x));
+	__m512d b = _mm512_add_pd(n,_mm512_set1_pd(6755399441055744.0+1023));
+	__m512d s = _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(b),52));
+	x = _mm512_mul_pd(x,s);
+	x = _mm512_mask_blend_pd(lo,x,_mm512_setzero_pd());
+	return _mm512_mask_blend_pd(hi,x,_mm512_set1_pd(INFINITY));
+}
+
+AVX512 inline void exp_shift(double* x, uint32_t len, double s)
+{
+	__m512d vs = _mm512_set1_pd(s);
+	uint32_t i = 0;
+	for(;i+8<=len;i+=8)
+		_mm512_storeu_pd(x+i,exp8(_mm512_sub_pd(_mm512_loadu_pd(x+i),vs)));
+	for(;i<len;i++)
+		x[i] = simd_scalar::exp1(x[i]-s);
+}
+
+AVX512 inline uint32_t search(const double* c, uint32_t len, double r)
+{
+	__m512d vr = _mm512_set1_pd(r);
+	uint32_t i = 0;
+	for(;i+8<=len;i+=8)
+	{
+		__mmask8 m = _mm512_cmp_pd_mask(_mm512_loadu_pd(c+i),vr,_CMP_GE_OQ);
+		if(m)
+			return i+__builtin_ctz(m);
+	}
+	for(;i<len;i++)
+		if(c[i]>=r)
+			return i;
+	return ~0u;
+}
+
+#undef AVX512
+}
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+
+/**
+ * The kernels in use, set once by simd_set()
+ */
+struct SimdKernels
+{
+	SimdLevel level;
+	double (*finite_mean)(const double*, uint32_t);
+	void (*exp_shift)(double*, uint32_t, double);
+	void (*cumsum)(const double*, double*, uint32_t);
+	uint32_t (*search)(const double*, uint32_t, double);
+};
+
+// Best level supported by the CPU
+inline SimdLevel simd_detect()
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+#endif
+	return SIMD_SCALAR;
+}
+
+/**
+ * Use kernels of level (at most the detected one), return the level.
+ * The prefix sum and the mean are the AVX2 ones with AVX-512, since a
+ * wider block would change the order of additions.
+ */
+inline SimdLevel simd_set(SimdKernels& s, SimdLevel level)
+{
+	SimdLevel best = simd_detect();
+	if(level==SIMD_AUTO or level>best)
+		level = best;
+	s.level = level;
+	s.finite_mean = simd_scalar::finite_mean;
+	s.exp_shift = simd_scalar::exp_shift;
+	s.cumsum = simd_scalar::cumsum;
+	s.search = simd_scalar::search;
+#ifdef SIMD_X86
+	if(level>=SIMD_AVX2)
+	{
+		s.finite_mean = simd_avx2::finite_mean;
+		s.exp_shift = simd_avx2::exp_shift;
+		s.cumsum = simd_avx2::cumsum;
+		s.search = simd_avx2::search;
+	}
+	if(level>=SIMD_AVX512)
+	{
+		s.exp_shift = simd_avx512::exp_shift;
+		s.search = simd_avx512::search;
+	}
+#endif
+	return level;
+}
+
+inline SimdKernels simd_auto()
+{
+	SimdKernels s;
+	simd_set(s,SIMD_AUTO);
+	return s;
+}
+
+inline SimdKernels& simd()
+{
+	static SimdKernels s = simd_auto();
+	return s;
+}
+
+inline SimdLevel simd_set(SimdLevel level)
+{
+	return simd_set(simd(),level);
+}
+
+inline const char* simd_name(SimdLevel level)
+{
+	static const char* name[] = {"scalar","avx2","avx512","auto"};
+	return name[level];
+}
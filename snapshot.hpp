@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vec.hpp"
+#include "qlog.hpp"
+
+/**
+ * Binary snapshot file: a sequence of items, each starting at a
+ * multiple of 8 bytes so that arrays are aligned when the file is
+ * mmap()ed. An array is stored as its uint64_t length, then its data.
+ */
+class SnapWriter
+{
+public:
+	FILE* f;
+	uint64_t pos;
+
+	SnapWriter(): f(NULL), pos(0) {}
+
+	~SnapWriter() { close(); }
+
+	void open(const char* filename)
+	{
+		if(!(f=fopen(filename,"wb")))
+			error("Cannot open %s for writing.\n",filename);
+		pos = 0;
+	}
+
+	void close()
+	{
+		if(NULL!=f)
+			qassert(0==fclose(f));
+		f = NULL;
+	}
+
+	void put(const void* x, uint64_t size)
+	{
+		static const char zero[8] = {0};
+		if(size>0)
+			qassert(1==fwrite(x,size,1,f));
+		pos += size;
+		if(pos%8)
+		{
+			qassert(1==fwrite(zero,8-pos%8,1,f));
+			pos += 8-pos%8;
+		}
+	}
+
+	template <typename T>
+	void put(const T& x) { put(&x,sizeof(T)); }
+
+	template <typename T>
+	void put_array(const T* x, uint64_t len)
+	{
+		put(len);
+		put(x,len*sizeof(T));
+	}
+
+	template <typename T>
+	void put_vec(const Vec<T>& v) { put_array(v.head,v.len); }
+
+	template <typename T>
+	void put_vec(const Span<T>& v) { put_array(v.head,v.len); }
+};
+
+class SnapReader
+{
+public:
+	const char* map;
+	uint64_t len;
+	uint64_t pos;
+	const char* filename;
+
+	SnapReader(): map(NULL), len(0), pos(0), filename(NULL) {}
+
+	~SnapReader() { close(); }
+
+	void open(const char* _filename)
+	{
+		filename = _filename;
+		int fd = ::open(filename,O_RDONLY);
+		if(fd<0)
+			error("Cannot open %s for reading.\n",filename);
+		struct stat st;
+		qassert(0==fstat(fd,&st));
+		len = st.st_size;
+		map = NULL;
+		if(len>0)
+		{
+			map = (const char*)mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+			if(MAP_FAILED==(void*)map)
+				error("Cannot mmap %s\n",filename);
+		}
+		::close(fd);
+		pos = 0;
+	}
+
+	void close()
+	{
+		if(NULL!=map)
+			munmap((void*)map,len);
+		map = NULL;
+	}
+
+	// Pointer to the next item of size bytes
+	const void* get(uint64_t size)
+	{
+		if(size>len-pos)
+			error("%s: truncated snapshot\n",filename);
+		const void* x = map+pos;
+		pos += (size+7)/8*8;
+		if(pos>len)
+			pos = len;
+		return x;
+	}
+
+	template <typename T>
+	T get() { T x; memcpy(&x,get(sizeof(T)),sizeof(T)); return x; }
+
+	// Length of the next array
+	uint64_t get_len() { return get<uint64_t>(); }
+
+	// Copy n items of the next array
+	template <typename T>
+	void get_array(T* x, uint64_t n)
+	{
+		if(n!=get_len())
+			error("%s: bad array length\n",filename);
+		if(n>0)
+			memcpy(x,get(n*sizeof(T)),n*sizeof(T));
+	}
+
+	template <typename T>
+	void get_vec(Vec<T>& v)
+	{
+		uint64_t n = get_len();
+		if(n>0xffffffffu)
+			error("%s: bad array length\n",filename);
+		v.resize(n);
+		if(n>0)
+			memcpy(v.head,get(n*sizeof(T)),n*sizeof(T));
+	}
+};
@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+#include "rng.hpp"
+#include "hdp.hpp"
+#include "qlog.hpp"
+
+/**
+ * Regression tests, run by make check; a failure aborts in qassert.
+ */
+
+// Emptied tables stay until remove_empty(), so a doc has up to twice as
+// many tables as words within a sweep: 32-bit records from 2*len+1 >=
+// 0xffff. With a huge alpha each word of a doc of distinct words opens a
+// new table, 2*len-2 in all, past 16 bits from 32770 words.
+void test_long_doc()
+{
+	const uint32_t n = 32770;
+	qassert(DocState::is_wide(32767) and not DocState::is_wide(32766));
+	HDP h(1,n);
+	for(uint32_t w=0;w<n;w++)
+		h.add_entry(0,w);
+	h.config(1e9,0.5,1);
+	h.sampler = HDP::SAMPLER_BUCKET;
+	h.init();
+	h.gibbs_table();
+	qassert(h.st.tab[0].len>0x10000);
+	h.check(false);
+	h.remove_empty();
+	h.check(false);
+}
+
+// A small corpus of Zipf-like words, the same for any call
+HDP* small_hdp(HDP::Sampler sampler, uint32_t n_thread)
+{
+	const uint32_t n_doc = 200, n_word = 500;
+	HDP* h = new HDP(n_doc,n_word);
+	uint64_t r = 7;
+	for(uint32_t d=0;d<n_doc;d++)
+	{
+		uint32_t len = 20+lcg64_r(&r)%60;
+		for(uint32_t i=0;i<len;i++)
+		{
+			double u = drand_r(&r);
+			h->add_entry(d,(uint32_t)(u*u*n_word));
+		}
+	}
+	h->config(1,0.5,1);
+	h->set_threads(n_thread);
+	h->sampler = sampler;
+	h->seed = 3;
+	h->state_init();
+	return h;
+}
+
+void iterate(HDP& h, uint32_t n)
+{
+	for(uint32_t i=0;i<n;i++)
+	{
+		h.gibbs_table();
+		h.remove_empty();
+		h.gibbs_menu();
+		h.remove_empty();
+	}
+}
+
+bool same_file(const char* a, const char* b)
+{
+	FILE* f = fopen(a,"rb");
+	FILE* g = fopen(b,"rb");
+	qassert(NULL!=f and NULL!=g);
+	bool same = true;
+	for(int x=0,y=0;same and EOF!=x;)
+	{
+		x = fgetc(f);
+		y = fgetc(g);
+		same = (x==y);
+	}
+	fclose(f);
+	fclose(g);
+	return same;
+}
+
+// 8 iterations in one run and 4+4 resumed from a checkpoint give the
+// same state, for each sampler (with the same number of threads)
+void test_resume()
+{
+	const char* a = "/tmp/hdp_test_a.bin";
+	const char* b = "/tmp/hdp_test_b.bin";
+	HDP::Sampler sampler[3] = {HDP::SAMPLER_PLAIN,HDP::SAMPLER_BUCKET,HDP::SAMPLER_ALIAS};
+	uint32_t n_thread[2] = {1,3};
+	for(uint32_t j=0;j<6;j++)
+	{
+		HDP* h = small_hdp(sampler[j/2],n_thread[j%2]);
+		lcg64(11);
+		h->init();
+		iterate(*h,8);
+		h->save(a,8);
+		delete h;
+
+		h = small_hdp(sampler[j/2],n_thread[j%2]);
+		lcg64(11);
+		h->init();
+		iterate(*h,4);
+		h->save(b,4);
+		delete h;
+
+		lcg64(99); // restored by load()
+		h = small_hdp(sampler[j/2],n_thread[j%2]);
+		qassert(4==h->load(b));
+		iterate(*h,4);
+		h->check(false);
+		h->save(b,8);
+		delete h;
+		qassert(same_file(a,b));
+	}
+	unlink(a);
+	unlink(b);
+}
+
+// prop_exp() and rmultinorm_r() give the same bits with each SIMD level
+// the CPU has, for lengths around the vector widths and with -inf terms
+void test_simd()
+{
+	SimdLevel best = simd_set(SIMD_AUTO);
+	uint32_t lens[] = {1,2,3,4,5,7,8,9,15,16,17,31,33,63,64,65,1000};
+	uint32_t n_len = sizeof(lens)/sizeof(lens[0]);
+	Vec<double> x, ref, p, cum, ref_cum;
+	Vec<uint32_t> draw, ref_draw;
+	for(uint32_t l=0;l<n_len;l++)
+	{
+		uint32_t len = lens[l];
+		uint64_t r = 5+len;
+		x.resize(len);
+		for(uint32_t i=0;i<len;i++)
+			x[i] = (i>0 and 0==i%5)?-INFINITY:-700*drand_r(&r);
+		for(uint32_t lv=SIMD_SCALAR;lv<=(uint32_t)best;lv++)
+		{
+			qassert(lv==(uint32_t)simd_set((SimdLevel)lv));
+			p.copy_from(x);
+			prop_exp(&(p[0]),len);
+			cum.resize(len);
+			draw.clear();
+			Rng rs;
+			rs.set(1,len,0,0);
+			for(uint32_t j=0;j<64;j++)
+				draw.push_back(rmultinorm_r(&rs,&(p[0]),&(cum[0]),len));
+			if(SIMD_SCALAR==lv)
+			{
+				ref.copy_from(p);
+				ref_cum.copy_from(cum);
+				ref_draw.copy_from(draw);
+				continue;
+			}
+			qassert(0==memcmp(&(p[0]),&(ref[0]),len*sizeof(double)));
+			qassert(0==memcmp(&(cum[0]),&(ref_cum[0]),len*sizeof(double)));
+			qassert(0==memcmp(&(draw[0]),&(ref_draw[0]),draw.len*sizeof(uint32_t)));
+		}
+	}
+	simd_set(SIMD_AUTO);
+}
+
+int main()
+{
+	test_simd();
+	test_resume();
+	test_long_doc();
+	printf("ok\n");
+	return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include "qlog.hpp"
 
 template <typename T>
@@ -45,10 +46,49 @@ public:
 		len = 0;
 	}
 
+	// Set length to n, keeping old content (new entries are uninitialized)
+	void resize(uint32_t n)
+	{
+		if(n>max_len)
+		{
+			max_len = n;
+			qassert((head=(T*)realloc(head,max_len*sizeof(T))));
+		}
+		len = n;
+	}
+
+	void copy_from(const Vec<T>& v)
+	{
+		resize(v.len);
+		if(len>0)
+			memcpy(head,v.head,len*sizeof(T));
+	}
+
 	T& operator[](uint32_t i)
 	{
 		qassert(i<len);
 		return head[i];
 	}
+
+	const T& operator[](uint32_t i) const
+	{
+		qassert(i<len);
+		return head[i];
+	}
 };
 
+/**
+ * Array of len T at head, owned by someone else
+ */
+template <typename T>
+struct Span
+{
+	T* head;
+	uint32_t len;
+
+	T& operator[](uint32_t i)
+	{
+		qassert(i<len);
+		return head[i];
+	}
+};
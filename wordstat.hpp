@@ -0,0 +1,635 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "vec.hpp"
+#include "arena.hpp"
+#include "snapshot.hpp"
+#include "qlog.hpp"
+
+/**
+ * Topic-word counts, one row per topic.
+ *
+ * A row is either a dense array of n_word counts, or a hash table
+ * (open addressing, linear probing) of the nonzero counts which
+ * becomes dense once it would take more memory than a dense row.
+ * With layout DENSE every row is dense from the start.
+ *
+ * With layout WORD there are no rows: the counts of a word over all
+ * topics are contiguous (n_word x col_cap matrix), see column().
+ * Rows and hash slots come from the arena pool, and go back to it.
+ */
+/**
+ * Change of word_stat[k][w] (made by a worker, or since a sync)
+ */
+struct Delta
+{
+	uint32_t k;
+	uint32_t w;
+	int32_t n;
+};
+
+static int cmp_delta(const void* a, const void* b)
+{
+	const Delta& x = *(const Delta*)a;
+	const Delta& y = *(const Delta*)b;
+	if(x.k!=y.k)
+		return (x.k>y.k)-(x.k<y.k);
+	return (x.w>y.w)-(x.w<y.w);
+}
+
+/**
+ * Net changes of word_stat since clear(), one entry per (k,w) found by
+ * a hash table (open addressing, linear probing): its size is bounded by
+ * the (k,w) touched, not by the number of changes.
+ */
+class Journal
+{
+public:
+	static const uint32_t EMPTY = ~0u;
+	static const uint32_t INIT_CAP = 1024;
+
+	Vec<Delta> x; // in order of the first change, n may be back to 0
+	uint32_t* slot; // index into x, EMPTY if unused
+	uint32_t cap; // power of 2, more than 2*x.len
+
+	Journal(): slot(NULL), cap(0) {}
+
+	~Journal() { free(slot); }
+
+	void clear()
+	{
+		x.clear();
+		if(cap>0)
+			memset(slot,0xff,cap*sizeof(uint32_t));
+	}
+
+	void add(uint32_t k, uint32_t w, int32_t n)
+	{
+		if(2*(x.len+1)>cap)
+			grow();
+		for(uint32_t s=hash(k,w,cap);;s=(s+1)&(cap-1))
+		{
+			uint32_t i = slot[s];
+			if(EMPTY==i)
+			{
+				slot[s] = x.len;
+				Delta dl = {k,w,n};
+				x.push_back(dl);
+				return;
+			}
+			if(x[i].k==k and x[i].w==w)
+			{
+				x[i].n += n;
+				return;
+			}
+		}
+	}
+
+	// The nonzero changes to d, by (k,w)
+	void get(Vec<Delta>& d) const
+	{
+		d.clear();
+		for(uint32_t i=0;i<x.len;i++)
+			if(0!=x[i].n)
+				d.push_back(x[i]);
+		if(d.len>0)
+			qsort(&(d[0]),d.len,sizeof(Delta),cmp_delta);
+	}
+
+private:
+	static uint32_t hash(uint32_t k, uint32_t w, uint32_t cap)
+	{
+		return (w*2654435761u^k*2246822519u)&(cap-1);
+	}
+
+	void grow()
+	{
+		cap = cap>0?2*cap:INIT_CAP;
+		free(slot);
+		qassert((slot=(uint32_t*)malloc(cap*sizeof(uint32_t))));
+		memset(slot,0xff,cap*sizeof(uint32_t));
+		for(uint32_t i=0;i<x.len;i++)
+		{
+			uint32_t s = hash(x[i].k,x[i].w,cap);
+			while(EMPTY!=slot[s])
+				s = (s+1)&(cap-1);
+			slot[s] = i;
+		}
+	}
+};
+
+class WordStat
+{
+public:
+	enum Layout { DENSE, SPARSE, WORD };
+
+	struct Row
+	{
+		uint32_t* dense; // n_word counts, or NULL for a hash row
+		uint32_t* key; // word id of the slot, EMPTY if unused
+		uint32_t* val; // count of the slot, may be 0
+		uint32_t cap; // number of slots, power of 2
+		uint32_t used; // number of slots in use
+	};
+
+	static const uint32_t EMPTY = ~0u;
+	static const uint32_t INIT_CAP = 16;
+
+	uint32_t n_word;
+	Layout layout;
+	uint32_t len; // number of topics
+	Vec<Row> row;
+	Vec<Row> spare; // rows of removed topics (all 0) for reuse
+	Arena pool;
+	uint32_t* col; // layout WORD: col[w*col_cap+k]
+	uint32_t col_cap;
+	Journal* journal; // if not NULL, add() adds its changes to it (not copied)
+
+	WordStat(): n_word(0), layout(DENSE), len(0), col(NULL), col_cap(0), journal(NULL) {}
+
+	~WordStat() { dtor(); }
+
+	void dtor()
+	{
+		pool.dtor(); // all rows at once
+		len = 0;
+		row.clear();
+		spare.clear();
+		free(col);
+		col = NULL;
+		col_cap = 0;
+	}
+
+	void init(uint32_t _n_word, Layout _layout)
+	{
+		dtor();
+		n_word = _n_word;
+		layout = _layout;
+	}
+
+	// Append an empty topic, return its index
+	uint32_t add_topic()
+	{
+		if(layout==WORD)
+		{
+			if(len==col_cap)
+				grow_col(4>2*col_cap?4:2*col_cap);
+			for(uint32_t w=0;w<n_word;w++)
+				col[(uint64_t)w*col_cap+len] = 0;
+			return len++;
+		}
+		Row r;
+		if(spare.len>0)
+		{
+			r = spare[spare.len-1];
+			spare.len--;
+		}
+		else
+		{
+			memset(&r,0,sizeof(Row));
+			if(layout==DENSE)
+				make_dense(r);
+		}
+		row.push_back(r);
+		return len++;
+	}
+
+	/**
+	 * Keep topics src[0],...,src[n-1] as topics 0,...,n-1. The other
+	 * topics must have no counts; their rows are kept for add_topic().
+	 */
+	void compact(const uint32_t* src, uint32_t n)
+	{
+		if(layout==WORD)
+		{
+			Vec<uint32_t> x(len>0?len:1);
+			x.resize(n);
+			for(uint32_t w=0;w<n_word;w++)
+			{
+				uint32_t* c = column(w);
+				for(uint32_t j=0;j<n;j++)
+					x[j] = c[src[j]];
+				memcpy(c,x.head,n*sizeof(uint32_t));
+			}
+			len = n;
+			return;
+		}
+		Vec<Row> r(len>0?len:1);
+		Vec<uint8_t> kept(len>0?len:1);
+		kept.resize(len);
+		memset(&(kept[0]),0,len);
+		for(uint32_t j=0;j<n;j++)
+		{
+			r.push_back(row[src[j]]);
+			kept[src[j]] = 1;
+		}
+		for(uint32_t k=0;k<len;k++)
+			if(!kept[k])
+				retire(row[k]);
+		row.copy_from(r);
+		len = n;
+	}
+
+	// Counts of word w indexed by topic, NULL unless layout is WORD
+	uint32_t* column(uint32_t w)
+	{
+		return (NULL!=col)?col+(uint64_t)w*col_cap:NULL;
+	}
+
+	uint32_t get(uint32_t k, uint32_t w) const
+	{
+		if(layout==WORD)
+			return col[(uint64_t)w*col_cap+k];
+		const Row& r = row[k];
+		if(likely(NULL!=r.dense))
+			return r.dense[w];
+		if(0==r.cap)
+			return 0;
+		for(uint32_t s=slot(w,r.cap);;s=(s+1)&(r.cap-1))
+		{
+			if(r.key[s]==w)
+				return r.val[s];
+			if(r.key[s]==EMPTY)
+				return 0;
+		}
+	}
+
+	void add(uint32_t k, uint32_t w, int32_t n)
+	{
+		if(unlikely(NULL!=journal))
+			journal->add(k,w,n);
+		if(layout==WORD)
+		{
+			col[(uint64_t)w*col_cap+k] += n;
+			return;
+		}
+		Row& r = row[k];
+		if(likely(NULL!=r.dense))
+		{
+			r.dense[w] += n;
+			return;
+		}
+		*find_or_insert(r,w) += n;
+	}
+
+	void inc(uint32_t k, uint32_t w) { add(k,w,1); }
+
+	void dec(uint32_t k, uint32_t w) { add(k,w,-1); }
+
+	// Number of nonzero counts in row k
+	uint32_t nnz(uint32_t k)
+	{
+		uint32_t s = 0;
+		if(layout==WORD)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				s += (get(k,w)>0);
+			return s;
+		}
+		Row& r = row[k];
+		if(NULL!=r.dense)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				s += (r.dense[w]>0);
+			return s;
+		}
+		for(uint32_t i=0;i<r.cap;i++)
+			s += (r.key[i]!=EMPTY and r.val[i]>0);
+		return s;
+	}
+
+	// Append the words with nonzero count in row k to x
+	void row_nz(uint32_t k, Vec<uint32_t>& x)
+	{
+		if(layout==WORD)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				if(get(k,w)>0)
+					x.push_back(w);
+			return;
+		}
+		Row& r = row[k];
+		if(NULL!=r.dense)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				if(r.dense[w]>0)
+					x.push_back(w);
+			return;
+		}
+		for(uint32_t i=0;i<r.cap;i++)
+			if(r.key[i]!=EMPTY and r.val[i]>0)
+				x.push_back(r.key[i]);
+	}
+
+	// Append the nonzero counts of row k and their words
+	void row_pairs(uint32_t k, Vec<uint32_t>& word, Vec<uint32_t>& cnt)
+	{
+		if(layout==WORD)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				if(col[(uint64_t)w*col_cap+k]>0)
+				{
+					word.push_back(w);
+					cnt.push_back(col[(uint64_t)w*col_cap+k]);
+				}
+			return;
+		}
+		Row& r = row[k];
+		if(NULL!=r.dense)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				if(r.dense[w]>0)
+				{
+					word.push_back(w);
+					cnt.push_back(r.dense[w]);
+				}
+			return;
+		}
+		for(uint32_t i=0;i<r.cap;i++)
+			if(r.key[i]!=EMPTY and r.val[i]>0)
+			{
+				word.push_back(r.key[i]);
+				cnt.push_back(r.val[i]);
+			}
+	}
+
+	// Write row k as n_word dense counts to x
+	void get_row(uint32_t k, uint32_t* x)
+	{
+		if(layout==WORD)
+		{
+			for(uint32_t w=0;w<n_word;w++)
+				x[w] = get(k,w);
+			return;
+		}
+		Row& r = row[k];
+		if(NULL!=r.dense)
+		{
+			memcpy(x,r.dense,n_word*sizeof(uint32_t));
+			return;
+		}
+		memset(x,0,n_word*sizeof(uint32_t));
+		for(uint32_t i=0;i<r.cap;i++)
+			if(r.key[i]!=EMPTY)
+				x[r.key[i]] = r.val[i];
+	}
+
+	// Bytes allocated for counts
+	uint64_t memory()
+	{
+		return (uint64_t)n_word*col_cap*sizeof(uint32_t)+pool.memory();
+	}
+
+	// Deep copy, reusing rows already allocated
+	void copy_from(WordStat& o)
+	{
+		n_word = o.n_word;
+		layout = o.layout;
+		if(layout==WORD)
+		{
+			if(col_cap!=o.col_cap)
+			{
+				free(col);
+				col_cap = o.col_cap;
+				qassert((col=(uint32_t*)malloc((uint64_t)n_word*col_cap*sizeof(uint32_t))));
+			}
+			memcpy(col,o.col,(uint64_t)n_word*col_cap*sizeof(uint32_t));
+			len = o.len;
+			return;
+		}
+		while(len>o.len)
+			free_row(row[--len]);
+		row.len = len;
+		while(len<o.len)
+		{
+			Row r;
+			memset(&r,0,sizeof(Row));
+			row.push_back(r);
+			len++;
+		}
+		for(uint32_t k=0;k<len;k++)
+		{
+			Row& r = row[k];
+			Row& s = o.row[k];
+			if(NULL!=s.dense)
+			{
+				if(NULL==r.dense)
+				{
+					free_row(r);
+					r.dense = pool.alloc(n_word);
+				}
+				memcpy(r.dense,s.dense,n_word*sizeof(uint32_t));
+				continue;
+			}
+			if(NULL!=r.dense or r.cap!=s.cap)
+			{
+				free_row(r);
+				r.cap = s.cap;
+				if(r.cap>0)
+				{
+					r.key = pool.alloc(r.cap);
+					r.val = pool.alloc(r.cap);
+				}
+			}
+			r.used = s.used;
+			if(r.cap>0)
+			{
+				memcpy(r.key,s.key,r.cap*sizeof(uint32_t));
+				memcpy(r.val,s.val,r.cap*sizeof(uint32_t));
+			}
+		}
+	}
+
+	// Write as is, including hash slots and spare rows
+	void save(SnapWriter& sw)
+	{
+		sw.put(n_word);
+		sw.put((uint32_t)layout);
+		sw.put(len);
+		if(layout==WORD)
+		{
+			sw.put(col_cap);
+			sw.put_array(col,(uint64_t)n_word*col_cap);
+			return;
+		}
+		for(uint32_t k=0;k<len;k++)
+			save_row(sw,row[k]);
+		sw.put(spare.len);
+		for(uint32_t k=0;k<spare.len;k++)
+			save_row(sw,spare[k]);
+	}
+
+	void load(SnapReader& sr)
+	{
+		dtor();
+		n_word = sr.get<uint32_t>();
+		layout = (Layout)sr.get<uint32_t>();
+		if(layout!=DENSE and layout!=SPARSE and layout!=WORD)
+			error("%s: bad layout\n",sr.filename);
+		len = sr.get<uint32_t>();
+		if(layout==WORD)
+		{
+			col_cap = sr.get<uint32_t>();
+			if(len>col_cap)
+				error("%s: bad number of topics\n",sr.filename);
+			if(col_cap>0)
+				qassert((col=(uint32_t*)malloc((uint64_t)n_word*col_cap*sizeof(uint32_t))));
+			sr.get_array(col,(uint64_t)n_word*col_cap);
+			return;
+		}
+		for(uint32_t k=0;k<len;k++)
+			row.push_back(load_row(sr));
+		uint32_t n = sr.get<uint32_t>();
+		for(uint32_t k=0;k<n;k++)
+			spare.push_back(load_row(sr));
+	}
+
+private:
+	void save_row(SnapWriter& sw, Row& r)
+	{
+		sw.put((uint32_t)(NULL!=r.dense));
+		if(NULL!=r.dense)
+		{
+			sw.put_array(r.dense,n_word);
+			return;
+		}
+		sw.put(r.cap);
+		sw.put(r.used);
+		sw.put_array(r.key,r.cap);
+		sw.put_array(r.val,r.cap);
+	}
+
+	Row load_row(SnapReader& sr)
+	{
+		Row r;
+		memset(&r,0,sizeof(Row));
+		if(sr.get<uint32_t>())
+		{
+			r.dense = pool.alloc(n_word);
+			sr.get_array(r.dense,n_word);
+			return r;
+		}
+		r.cap = sr.get<uint32_t>();
+		r.used = sr.get<uint32_t>();
+		if(r.cap&(r.cap-1))
+			error("%s: bad hash row\n",sr.filename);
+		if(r.cap>0)
+		{
+			r.key = pool.alloc(r.cap);
+			r.val = pool.alloc(r.cap);
+		}
+		sr.get_array(r.key,r.cap);
+		sr.get_array(r.val,r.cap);
+		return r;
+	}
+
+	static uint32_t slot(uint32_t w, uint32_t cap)
+	{
+		return (w*2654435761u)&(cap-1);
+	}
+
+	// Reallocate the word-major matrix with room for cap topics
+	void grow_col(uint32_t cap)
+	{
+		uint32_t* x = (uint32_t*)malloc((uint64_t)n_word*cap*sizeof(uint32_t));
+		qassert(x);
+		for(uint32_t w=0;w<n_word;w++)
+			memcpy(x+(uint64_t)w*cap,col+(uint64_t)w*col_cap,len*sizeof(uint32_t));
+		free(col);
+		col = x;
+		col_cap = cap;
+	}
+
+	// Keep an empty row for reuse
+	void retire(Row& r)
+	{
+		if(NULL==r.dense and r.cap>0)
+		{
+			memset(r.key,0xff,r.cap*sizeof(uint32_t));
+			r.used = 0;
+		}
+		spare.push_back(r);
+	}
+
+	void free_row(Row& r)
+	{
+		pool.release(r.dense,n_word);
+		pool.release(r.key,r.cap);
+		pool.release(r.val,r.cap);
+		memset(&r,0,sizeof(Row));
+	}
+
+	void make_dense(Row& r)
+	{
+		uint32_t* x = pool.alloc(n_word);
+		memset(x,0,n_word*sizeof(uint32_t));
+		for(uint32_t i=0;i<r.cap;i++)
+			if(r.key[i]!=EMPTY)
+				x[r.key[i]] = r.val[i];
+		free_row(r);
+		r.dense = x;
+	}
+
+	// Rebuild the hash with zero counts dropped, or turn dense
+	void rehash(Row& r)
+	{
+		uint32_t n = 0;
+		for(uint32_t i=0;i<r.cap;i++)
+			n += (r.key[i]!=EMPTY and r.val[i]>0);
+		uint32_t cap = INIT_CAP;
+		while(cap<4*(n+1))
+			cap *= 2;
+		// a slot takes 2 words, the dense row n_word
+		if(cap*2>=n_word)
+		{
+			make_dense(r);
+			return;
+		}
+		uint32_t* key = pool.alloc(cap);
+		uint32_t* val = pool.alloc(cap);
+		memset(key,0xff,cap*sizeof(uint32_t));
+		for(uint32_t i=0;i<r.cap;i++)
+			if(r.key[i]!=EMPTY and r.val[i]>0)
+			{
+				uint32_t s = slot(r.key[i],cap);
+				while(key[s]!=EMPTY)
+					s = (s+1)&(cap-1);
+				key[s] = r.key[i];
+				val[s] = r.val[i];
+			}
+		pool.release(r.key,r.cap);
+		pool.release(r.val,r.cap);
+		r.key = key;
+		r.val = val;
+		r.cap = cap;
+		r.used = n;
+	}
+
+	uint32_t* find_or_insert(Row& r, uint32_t w)
+	{
+		if(r.cap>0)
+			for(uint32_t s=slot(w,r.cap);;s=(s+1)&(r.cap-1))
+			{
+				if(r.key[s]==w)
+					return &r.val[s];
+				if(r.key[s]==EMPTY)
+					break;
+			}
+		// keep load factor below 1/2
+		if(2*(r.used+1)>r.cap)
+		{
+			rehash(r);
+			if(NULL!=r.dense)
+				return &r.dense[w];
+		}
+		uint32_t s = slot(w,r.cap);
+		while(r.key[s]!=EMPTY)
+			s = (s+1)&(r.cap-1);
+		r.key[s] = w;
+		r.val[s] = 0;
+		r.used++;
+		return &r.val[s];
+	}
+};